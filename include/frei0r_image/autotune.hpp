@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Time the ways a plugin can be run at a resolution on this machine and
+ * keep the fastest in a cache file, so each is only measured once.
+ */
+
+#ifndef FREI0R_IMAGE_AUTOTUNE_HPP
+#define FREI0R_IMAGE_AUTOTUNE_HPP
+
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+// model name from /proc/cpuinfo, "unknown" if there isn't one
+std::string cpuModel();
+
+struct TuneResult
+{
+  // 0 is a single instance, otherwise tiles of this size run on the pool
+  unsigned int tile_size = 0;
+  // mean per frame
+  double seconds = 0.0;
+};
+
+class TuningCache
+{
+public:
+  explicit TuningCache(const std::string& path);
+
+  // plugin path, plugin version, resolution and cpu model
+  static std::string key(const Plugin& plugin, const unsigned int width,
+      const unsigned int height);
+  bool find(const std::string& key, TuneResult& result);
+  // written to the file right away, along with whatever other processes
+  // have added to it since it was read
+  void store(const std::string& key, const TuneResult& result);
+
+private:
+  void read(std::map<std::string, TuneResult>& entries) const;
+
+  std::string path_;
+  std::mutex mutex_;
+  std::map<std::string, TuneResult> entries_;
+};
+
+// Time a single instance and tiles of each of tile_sizes smaller than the
+// frame, about budget seconds in all, with values for parameters and noise
+// for inputs. Tiles are only tried with a pool and never for sources, the
+// caller has to leave out plugins that can't be tiled. Only makes new
+// instances of plugin, so it can run on another thread than the one using
+// plugin.instance_.
+TuneResult autotune(Plugin& plugin, const ParamValues& values, const unsigned int width,
+    const unsigned int height, const std::vector<unsigned int>& tile_sizes,
+    const unsigned int halo, ThreadPool* pool, const double budget);
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_AUTOTUNE_HPP
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Vectorized versions of a few of the simplest and most used frei0r
+ * plugins, compiled in and loaded by names like builtin:addition instead
+ * of a path. They have the same parameters as the originals.
+ */
+
+#ifndef FREI0R_IMAGE_BUILTIN_HPP
+#define FREI0R_IMAGE_BUILTIN_HPP
+
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+struct Plugin;
+
+// "builtin:" followed by the file name stem of the plugin it replaces,
+// so /usr/lib/frei0r-1/addition.so becomes builtin:addition
+bool isBuiltin(const std::string& name);
+std::vector<std::string> builtinNames();
+// point the entry points of plugin at a builtin, false if there is none by that name
+bool loadBuiltin(const std::string& name, Plugin& plugin);
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_BUILTIN_HPP
@@ -0,0 +1,27 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Encode output frames for sensor_msgs/CompressedImage.
+ */
+
+#ifndef FREI0R_IMAGE_COMPRESS_HPP
+#define FREI0R_IMAGE_COMPRESS_HPP
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+// Encode a CV_8UC4 bgra frame as "jpeg" or "png" into data. quality is
+// 1 - 100 for jpeg and the 0 - 9 compression level for png. Safe to call
+// from several threads at once.
+bool compressFrame(const cv::Mat& bgra, const std::string& format, const int quality,
+    std::vector<uint8_t>& data);
+// the CompressedImage format string compressed_image_transport uses
+std::string compressedFormat(const std::string& format);
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_COMPRESS_HPP
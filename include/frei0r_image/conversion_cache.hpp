@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Several nodelets in one manager often subscribe to the same images at
+ * the same size, this lets them share one conversion of each message.
+ */
+
+#ifndef FREI0R_IMAGE_CONVERSION_CACHE_HPP
+#define FREI0R_IMAGE_CONVERSION_CACHE_HPP
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <sensor_msgs/Image.h>
+#include <string>
+#include <tuple>
+
+namespace frei0r_image
+{
+
+class ConversionCache
+{
+public:
+  // the one every nodelet in this process shares
+  static ConversionCache& instance();
+
+  // msg converted to encoding and resized (bilinear) to size, done
+  // once for however many callers ask for the same thing. The result must
+  // not be written to. Throws cv_bridge::Exception.
+  std::shared_ptr<const cv::Mat> get(const sensor_msgs::ImageConstPtr& msg,
+      const std::string& encoding, const cv::Size& size);
+
+private:
+  ConversionCache() {}
+
+  typedef std::tuple<const sensor_msgs::Image*, std::string, int, int> Key;
+  struct Entry
+  {
+    // holding the message keeps its address from being reused for another
+    sensor_msgs::ImageConstPtr msg;
+    std::chrono::steady_clock::time_point made;
+    // the first caller converts while holding this, the rest wait for it
+    std::mutex mutex;
+    std::shared_ptr<const cv::Mat> frame;
+  };
+
+  // drop entries older than lifetime_
+  void prune(const std::chrono::steady_clock::time_point now);
+
+  // long enough for every subscriber of one message to have been called
+  const std::chrono::milliseconds lifetime_{500};
+  std::mutex mutex_;
+  std::map<Key, std::shared_ptr<Entry>> entries_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_CONVERSION_CACHE_HPP
@@ -0,0 +1,21 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Halve bgra frames for the smaller outputs of a pipeline.
+ */
+
+#ifndef FREI0R_IMAGE_DOWNSAMPLE_HPP
+#define FREI0R_IMAGE_DOWNSAMPLE_HPP
+
+#include <opencv2/core.hpp>
+
+namespace frei0r_image
+{
+
+// Average each 2x2 block of the CV_8UC4 src into one pixel of dst, which
+// has to already be src.cols / 2 x src.rows / 2 CV_8UC4 so it can point
+// into a buffer the caller reuses. An odd last row or column is dropped.
+void downsample2x(const cv::Mat& src, cv::Mat& dst);
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_DOWNSAMPLE_HPP
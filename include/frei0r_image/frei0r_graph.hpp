@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Run a whole graph of frei0r plugins inside one nodelet, the graph is
+ * described in yaml (see config/graph.yaml) and frames pass between the
+ * plugins as plain buffers instead of ros topics.
+ */
+
+#ifndef FREI0R_IMAGE_FREI0R_GRAPH_HPP
+#define FREI0R_IMAGE_FREI0R_GRAPH_HPP
+
+#include <condition_variable>
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <memory>
+#include <mutex>
+#include <nodelet/nodelet.h>
+#include <opencv2/core.hpp>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+struct GraphNode
+{
+  std::string name;
+  // null for nodes that take their frames from a topic
+  std::unique_ptr<Plugin> plugin;
+
+  // the input nodes in plugin order, a feedback input gets the frame
+  // its node made on the previous update
+  std::vector<size_t> inputs;
+  std::vector<bool> feedback;
+  // nodes that wait on this one within an update
+  std::vector<size_t> dependents;
+  size_t num_deps = 0;
+  size_t deps_left = 0;
+
+  // indices into Frei0rGraph::buffers_, a node read through a feedback
+  // edge alternates between two so last frame's output survives
+  int buffers[2] = {-1, -1};
+  // inputs, outputs and feedback sources keep their buffers to themselves,
+  // everything else shares them with nodes that run once it is dead
+  bool dedicated = false;
+  bool feedback_source = false;
+
+  std::mutex input_mutex;
+  sensor_msgs::ImageConstPtr pending;
+  ros::Subscriber sub;
+
+  bool publish = false;
+  ros::Publisher pub;
+};
+
+class Frei0rGraph : public nodelet::Nodelet
+{
+public:
+  Frei0rGraph();
+  ~Frei0rGraph();
+  virtual void onInit();
+
+  void update(const ros::TimerEvent& event);
+  void imageCallback(const sensor_msgs::ImageConstPtr& msg, const size_t index);
+
+private:
+  // throws std::runtime_error on a bad description
+  void load(XmlRpc::XmlRpcValue& graph);
+  void setParams(GraphNode& node, XmlRpc::XmlRpcValue& params);
+  // topological order of the same frame edges, throws on a cycle
+  void sortNodes();
+  void assignBuffers();
+
+  // where the given node writes, or reads an input, for the current frame
+  uint32_t* output(const GraphNode& node);
+  const uint32_t* input(const GraphNode& node, const size_t ind);
+
+  void schedule(const size_t index);
+  void runNode(const size_t index);
+
+  std::vector<std::unique_ptr<GraphNode>> nodes_;
+  std::vector<size_t> order_;
+  std::vector<cv::Mat> buffers_;
+  unsigned int width_ = 640;
+  unsigned int height_ = 480;
+  uint64_t frame_ = 0;
+  double time_ = 0.0;
+
+  std::unique_ptr<ThreadPool> pool_;
+  std::mutex run_mutex_;
+  std::condition_variable run_cond_;
+  size_t remaining_ = 0;
+
+  ros::Timer timer_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_FREI0R_GRAPH_HPP
@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Logging for frei0r_image_core, which can't use rosconsole. Messages go
+ * to stderr unless something else, like the nodelets, sets a handler.
+ */
+
+#ifndef FREI0R_IMAGE_LOG_HPP
+#define FREI0R_IMAGE_LOG_HPP
+
+#include <functional>
+#include <sstream>
+#include <string>
+
+namespace frei0r_image
+{
+
+enum class LogLevel { DEBUG, INFO, WARN, ERROR };
+
+typedef std::function<void(const LogLevel level, const std::string& text)> LogHandler;
+
+// nullptr goes back to stderr
+void setLogHandler(LogHandler handler);
+void log(const LogLevel level, const std::string& text);
+
+}  // namespace frei0r_image
+
+#define FREI0R_LOG_STREAM(level, args) \
+  do { \
+    std::stringstream frei0r_log_ss; \
+    frei0r_log_ss << args; \
+    frei0r_image::log(level, frei0r_log_ss.str()); \
+  } while (0)
+
+#define FREI0R_DEBUG_STREAM(args) FREI0R_LOG_STREAM(frei0r_image::LogLevel::DEBUG, args)
+#define FREI0R_INFO_STREAM(args) FREI0R_LOG_STREAM(frei0r_image::LogLevel::INFO, args)
+#define FREI0R_WARN_STREAM(args) FREI0R_LOG_STREAM(frei0r_image::LogLevel::WARN, args)
+#define FREI0R_ERROR_STREAM(args) FREI0R_LOG_STREAM(frei0r_image::LogLevel::ERROR, args)
+
+#endif  // FREI0R_IMAGE_LOG_HPP
@@ -0,0 +1,290 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * One plugin with its own inputs, output and parameters, a Frei0rImage
+ * nodelet hosts one or more of these.
+ */
+
+#ifndef FREI0R_IMAGE_PIPELINE_HPP
+#define FREI0R_IMAGE_PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ddynamic_reconfigure/ddynamic_reconfigure.h>
+#include <frei0r_image/LoadPlugin.h>
+#include <frei0r_image/ParamBatch.h>
+#include <frei0r_image/ProcessImage.h>
+#include <frei0r_image/ShmFrame.h>
+#include <frei0r_image/autotune.hpp>
+#include <frei0r_image/compress.hpp>
+#include <frei0r_image/downsample.hpp>
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/remote_plugin.hpp>
+#include <frei0r_image/render_ahead.hpp>
+#include <frei0r_image/shm_ring.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <frei0r_image/tiled_instance.hpp>
+#include <frei0r_image/trace.hpp>
+#include <frei0r_image/video_reader.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ros/ros.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/RegionOfInterest.h>
+#include <std_msgs/Float32.h>
+#include <std_msgs/UInt32.h>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+class Pipeline
+{
+public:
+  // topics go on nh, parameters and services on private_nh,
+  // name keeps the shared memory segments of each pipeline apart,
+  // pool is where the tiles of large frames run
+  Pipeline(ros::NodeHandle nh, ros::NodeHandle private_nh, const std::string& name,
+      ThreadPool* pool);
+  // the instances made from plugin_ have to go before it does
+  ~Pipeline();
+
+  void widthCallback(int width);
+  void heightCallback(int height);
+  void deadlineCallback(double deadline);
+  void boolCallback(bool value, int param_ind);
+
+  void doubleCallback(double value, int param_ind);
+  void doubleMsgCallback(std_msgs::Float32::ConstPtr msg, int param_ind);
+
+  void positionXCallback(double value, int param_ind);
+  void positionYCallback(double value, int param_ind);
+  void colorRCallback(double value, int param_ind);
+  void colorGCallback(double value, int param_ind);
+  void colorBCallback(double value, int param_ind);
+  void stringCallback(const std::string value, int param_ind);
+  // any number of typed values and curves, all land before the same update
+  void paramBatchCallback(const ParamBatchConstPtr& msg);
+
+  // runs on a thread pool worker
+  void update(const ros::Time& stamp);
+
+  void imageCallback(const sensor_msgs::ImageConstPtr& msg, const size_t index);
+  // all zeros goes back to processing the whole frame
+  void roiCallback(const sensor_msgs::RegionOfInterestConstPtr& msg);
+  void shmCallback(const ShmFrameConstPtr& msg, const size_t index);
+
+  const std::string& name() const
+  {
+    return name_;
+  }
+  // larger runs first when the pool is backed up
+  int priority() const
+  {
+    return priority_;
+  }
+
+  // set while an update is queued or running so a slow pipeline
+  // doesn't pile up more of them, returns false if one already is
+  bool beginUpdate()
+  {
+    return !busy_.exchange(true);
+  }
+  void endUpdate()
+  {
+    busy_ = false;
+  }
+  // updates that were skipped because the previous one hadn't finished
+  void skipUpdate();
+
+private:
+  // queue value on instance for its next updateParams, false if it
+  // doesn't fit the parameter
+  bool queueParamValue(Instance& instance, const ParamValue& value);
+  // convert the newest pending message on each input into the instance,
+  // dropping any that are older than the deadline
+  void convertInputs(const ros::Time& now);
+  void convertInput(const cv::Mat& image, const size_t index);
+  // the frame due now from a video input, if there is a new one
+  void convertVideo(const ros::Time& now, const size_t index);
+  void publishShm(const ros::Time& stamp);
+  // encode on the pool while the next update runs
+  void publishCompressed(const sensor_msgs::ImageConstPtr& msg);
+  // halve the output for each level down to the deepest one subscribed to
+  void publishPyramid(const ros::Time& stamp, const cv::Mat& frame);
+  // the output of the instance or the tiles
+  void render(const ros::Time& stamp, uint32_t* out_frame);
+  // input 0 with the instance output over frame_roi_
+  void renderRoi(const ros::Time& stamp, uint32_t* out_frame);
+  // roi_ grown to multiples of 64, clipped to the frame and shrunk to
+  // multiples of 8, empty if that leaves nothing or roi_ is the whole
+  // frame. keep is the part of roi_ inside it.
+  cv::Rect activeRoi(cv::Rect& keep) const;
+  cv::Size outputSize() const;
+  // has to happen before plugin_ goes away
+  void stopRenderAhead();
+  // set plugin_tile_size_ from the cache, or start measuring it on the
+  // pool and pick up the result on a later update
+  void autotuneTileSize();
+  void startAutotune();
+  // has to happen before plugin_ goes away, like stopRenderAhead
+  void cancelAutotune();
+  // time since the previous stage goes into trace_frame_
+  void traceStage(const TraceFrame::Stage stage);
+  void writeTrace(const cv::Mat& frame);
+
+  ros::NodeHandle nh_;
+  ros::NodeHandle private_nh_;
+  std::string name_;
+  int priority_ = 0;
+
+  // update runs on the pool while the ros callbacks replace the plugin
+  // and its parameters, this keeps them apart
+  std::mutex mutex_;
+  std::atomic<bool> busy_{false};
+  uint32_t skipped_ = 0;
+  ros::Publisher skipped_pub_;
+
+  ros::Publisher pub_;
+  ros::Subscriber sub_[3];
+
+  // image_out/compressed when ~compress is jpeg or png, at most one
+  // encode per pool worker is in flight and frames beyond that are dropped
+  std::string compress_;
+  int compress_quality_ = 80;
+  ros::Publisher compressed_pub_;
+  std::atomic<size_t> encoding_{0};
+
+  // image_out_half, image_out_quarter and so on
+  struct PyramidLevel
+  {
+    ros::Publisher pub;
+    // reused once nothing else holds them
+    std::vector<sensor_msgs::ImagePtr> pool;
+  };
+  std::vector<PyramidLevel> pyramid_;
+  // age in seconds of each converted input frame, and the running count
+  // of input frames that were never converted
+  ros::Publisher age_pub_[3];
+  ros::Publisher dropped_pub_[3];
+
+  // only the newest message per input is kept, anything it replaces
+  // before the next update counts as dropped
+  std::mutex input_mutex_;
+  sensor_msgs::ImageConstPtr pending_msgs_[3];
+  ShmFrameConstPtr pending_shm_[3];
+  // from ~roi_* and the roi topic, copied into roi_ each update
+  cv::Rect pending_roi_;
+  uint32_t dropped_[3] = {0, 0, 0};
+  // seconds, 0.0 disables dropping late frames
+  double deadline_ = 0.0;
+
+  // same host processes can exchange frames through shared memory,
+  // inputs also arrive as descriptors on image_inN_shm
+  ros::Subscriber shm_sub_[3];
+  ShmRingReader shm_readers_[3];
+  // inputs with ~image_inN_video set come from a file decoded ahead of
+  // time instead of from their topics
+  std::unique_ptr<VideoReader> video_readers_[3];
+  // output is written straight into the ring and described on image_out_shm,
+  // image_out then only gets published if something subscribes to it
+  bool shm_out_ = false;
+  int shm_slots_ = 4;
+  std::unique_ptr<ShmRingWriter> shm_writer_;
+  ros::Publisher shm_pub_;
+  std::unique_ptr<ddynamic_reconfigure::DDynamicReconfigure> ddr_;
+  std::map<std::string, ros::Subscriber> param_subs_;
+  ros::Subscriber param_batch_sub_;
+
+  ros::ServiceServer load_plugin_srv_;
+  bool loadPlugin(LoadPlugin::Request& req, LoadPlugin::Response& resp);
+
+  // process_image runs on service_instance_, which starts from the values
+  // of plugin_->instance_ each call. service_mutex_ is taken before mutex_
+  // and only holds mutex_ long enough to copy those, so a request and the
+  // updates only wait on each other for that.
+  ros::ServiceServer process_image_srv_;
+  bool processImage(ProcessImage::Request& req, ProcessImage::Response& resp);
+  std::mutex service_mutex_;
+  std::unique_ptr<Instance> service_instance_;
+
+  bool setupPlugin(const std::string& plugin_name);
+
+  unsigned int new_width_ = 320;
+  unsigned int new_height_ = 240;
+
+  // Frames larger than tile_size_ either way go through tiled_ instead,
+  // plugin_->instance_ then only holds the parameters. Only plugins
+  // listed in ~tile_halos/<plugin file name> are tiled, with that halo
+  // or ~tile_halo if it is negative, and never sources.
+  ThreadPool* pool_;
+  unsigned int tile_size_ = 2048;
+  unsigned int tile_halo_ = 16;
+  unsigned int plugin_halo_ = 16;
+  bool plugin_tileable_ = false;
+  std::unique_ptr<TiledInstance> tiled_;
+  // With ~autotune each tileable plugin and resolution gets whichever of a
+  // single instance or ~autotune_tile_sizes is fastest, measured on the
+  // pool over ~autotune_budget seconds the first time and after that
+  // looked up in ~autotune_cache.
+  unsigned int plugin_tile_size_ = 2048;
+  std::unique_ptr<TuningCache> tuning_cache_;
+  std::vector<unsigned int> autotune_tile_sizes_ = {256, 512, 1024};
+  double autotune_budget_ = 2.0;
+  cv::Size tuned_size_;
+  // the measuring queued or running on the pool, shared with its task
+  struct AutotuneJob
+  {
+    std::mutex mutex;
+    std::condition_variable cond;
+    cv::Size size;
+    // skip the measuring if it hasn't started yet
+    bool cancelled = false;
+    bool running = false;
+    bool done = false;
+    // false if autotune threw
+    bool ok = false;
+    TuneResult result;
+  };
+  std::shared_ptr<AutotuneJob> autotune_job_;
+
+  // allocate and touch instance frames when they are made, see ~lock_memory
+  bool prefault_ = false;
+
+  // ~render_ahead frames of source plugins are rendered on the pool ahead
+  // of the ticks they are for, which are expected tick_period_ apart
+  int render_ahead_ = 0;
+  std::shared_ptr<RenderAhead> ahead_;
+  ros::Time last_stamp_;
+  double tick_period_ = 0.1;
+
+  // With a roi the instance is only the size of the roi. Inputs are
+  // converted into full frames here and just the roi is cut out for the
+  // plugin, the rest of input 0 passes through to the output. The
+  // instance runs on frame_roi_ but only keep_roi_ of its output is used.
+  cv::Rect roi_;
+  cv::Rect frame_roi_;
+  cv::Rect keep_roi_;
+  ros::Subscriber roi_sub_;
+  cv::Mat roi_frames_[3];
+  std::vector<uint32_t> roi_out_;
+
+  // ~trace_file keeps the last ~trace_megabytes of output frames, with
+  // their input stamps, stage timings and parameters
+  std::unique_ptr<TraceWriter> trace_;
+  TraceFrame trace_frame_;
+  ParamValues trace_params_;
+  std::chrono::steady_clock::time_point trace_mark_;
+
+  // isolate runs plugins in a watchdogged frei0r_worker process
+  WorkerConfig worker_config_;
+
+  std::unique_ptr<Plugin> plugin_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_PIPELINE_HPP
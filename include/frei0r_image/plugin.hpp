@@ -0,0 +1,319 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Load and run frei0r plugins, with no ros dependency so headless tools
+ * can use them through frei0r_image_core.
+ */
+
+#ifndef FREI0R_IMAGE_PLUGIN_HPP
+#define FREI0R_IMAGE_PLUGIN_HPP
+
+#include <array>
+// TODO(lucasw) there is a C++ header in the latest frei0r sources,
+// but it isn't in Ubuntu 18.04 released version currently
+// #define _UNIX03_SOURCE
+#include <dlfcn.h>
+#include <frei0r.h>
+#include <frei0r_image/remote_plugin.hpp>
+#include <map>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace frei0r_image
+{
+
+std::string sanitize(const std::string& text);
+void adjustWidthHeight(unsigned int& width, unsigned int& height);
+
+typedef int  (*f0r_init_t)();
+typedef void (*f0r_deinit_t)();
+typedef void (*f0r_get_plugin_info_t)(f0r_plugin_info_t* info);
+typedef void (*f0r_get_param_info_t)(f0r_param_info_t* info,
+             int param_index);
+typedef f0r_instance_t (*f0r_construct_t)(int width, int height);
+typedef void (*f0r_destruct_t)(f0r_instance_t instance);
+
+typedef void (*f0r_set_param_value_t)(f0r_instance_t instance,
+            f0r_param_t param, int param_index);
+
+typedef void (*f0r_get_param_value_t)(f0r_instance_t instance,
+            f0r_param_t param, int param_index);
+
+typedef void (*f0r_update_t)(f0r_instance_t instance, double time,
+           const uint32_t* inframe, uint32_t* outframe);
+
+typedef void (*f0r_update2_t)(f0r_instance_t instance, double time,
+      const uint32_t* inframe1,
+      const uint32_t* inframe2,
+      const uint32_t* inframe3,
+      uint32_t* outframe);
+
+bool getPluginInfo(const std::string& name, std::string& plugin_name,
+    int& plugin_type);  // f0r_plugin_info_t& info);
+
+// What the plugin reported about one parameter, copied once when it is
+// loaded so nothing later has to call back into the plugin to find out.
+struct ParamDescriptor
+{
+  std::string name;
+  // sanitize(name), what ddr and the graph config use
+  std::string ros_name;
+  int type = F0R_PARAM_DOUBLE;
+  std::string explanation;
+  // numbers in a value, 0 for strings
+  size_t num_values = 1;
+};
+typedef std::vector<ParamDescriptor> ParamDescriptors;
+
+// Drives one number of a parameter every frame, either interpolated
+// between keyframes or from a low frequency oscillator.
+struct ParamCurve
+{
+  enum Mode { KEYFRAMES, LFO };
+  enum Waveform { SINE, TRIANGLE, SQUARE, SAW };
+
+  Mode mode = KEYFRAMES;
+  // the parameter type, so the value can be set without asking the plugin
+  int type = F0R_PARAM_DOUBLE;
+  // seconds, times below are relative to it
+  double start = 0.0;
+
+  // sorted and the same size
+  std::vector<double> times;
+  std::vector<double> values;
+  bool loop = false;
+
+  Waveform waveform = SINE;
+  double frequency = 1.0;
+  // in cycles
+  double phase = 0.0;
+  double offset = 0.5;
+  double amplitude = 0.5;
+
+  double evaluate(const double time) const;
+};
+
+struct Instance;
+
+// how many input frames a plugin of this F0R_PLUGIN_TYPE_ takes
+size_t numInputs(const int plugin_type);
+
+// Every parameter value of an instance, for copying to other instances of
+// the same plugin without setting the ones that haven't changed.
+struct ParamValues
+{
+  struct Value
+  {
+    double numbers[3] = {0.0, 0.0, 0.0};
+    std::string text;
+    bool operator==(const Value& other) const;
+  };
+  std::vector<Value> values;
+
+  void read(Instance& from);
+  // set the values that differ from previous, or all of them without it
+  void write(Instance& to, const ParamValues* previous = nullptr) const;
+  bool operator==(const ParamValues& other) const
+  {
+    return values == other.values;
+  }
+};
+
+struct Instance
+{
+  Instance(unsigned int& width, unsigned int& height,
+    f0r_construct_t construct,
+    f0r_destruct_t destruct,
+    f0r_update_t update1,
+    f0r_update2_t update2,
+    f0r_plugin_info fi,
+    std::shared_ptr<const ParamDescriptors> params,
+    f0r_get_param_value_t get_param_value,
+    f0r_set_param_value_t set_param_value,
+    std::shared_ptr<RemoteWorker> remote = nullptr);
+
+  ~Instance();
+  f0r_instance_t instance_ = nullptr;
+
+  // apply the queued parameter changes and then the curves at time
+  void updateParams(const double time);
+  // parameter values, queued changes and curves of another instance of
+  // the same plugin, for replacing it with one of a different size
+  void copyState(Instance& from);
+
+  // these go to the worker process instead of the plugin when remote_ is set
+  void setParam(f0r_param_t param, const int ind);
+  void getParam(f0r_param_t param, const int ind);
+  void process(const double time, const uint32_t* in0, const uint32_t* in1,
+      const uint32_t* in2, uint32_t* out);
+
+  void setParamValue(double value, const int ind)
+  {
+    setParam(reinterpret_cast<f0r_param_t>(&value), ind);
+  }
+
+  void setParamValue(const bool pre_value, const int ind)
+  {
+    double value = pre_value ? 1.0 : 0.0;
+    setParam(reinterpret_cast<f0r_param_t>(&value), ind);
+  }
+
+  void setColorR(const double r, const int ind)
+  {
+    f0r_param_color_t color;
+    getParam(reinterpret_cast<f0r_param_t>(&color), ind);
+    color.r = r;
+    setParam(reinterpret_cast<f0r_param_t>(&color), ind);
+  }
+
+  void setColorG(const double g, const int ind)
+  {
+    f0r_param_color_t color;
+    getParam(reinterpret_cast<f0r_param_t>(&color), ind);
+    color.g = g;
+    setParam(reinterpret_cast<f0r_param_t>(&color), ind);
+  }
+
+  void setColorB(const double b, const int ind)
+  {
+    f0r_param_color_t color;
+    getParam(reinterpret_cast<f0r_param_t>(&color), ind);
+    color.b = b;
+    setParam(reinterpret_cast<f0r_param_t>(&color), ind);
+  }
+
+  void setPositionX(const double x, const int ind)
+  {
+    f0r_param_position_t pos;
+    getParam(reinterpret_cast<f0r_param_t>(&pos), ind);
+    pos.x = x;
+    setParam(reinterpret_cast<f0r_param_t>(&pos), ind);
+  }
+
+  void setPositionY(const double y, const int ind)
+  {
+    f0r_param_position_t pos;
+    getParam(reinterpret_cast<f0r_param_t>(&pos), ind);
+    pos.y = y;
+    setParam(reinterpret_cast<f0r_param_t>(&pos), ind);
+  }
+
+  void setString(std::string text, const int ind)
+  {
+    // frei0r string params are passed as a pointer to the char pointer
+    f0r_param_string value = &*text.begin();
+    setParam(reinterpret_cast<f0r_param_t>(&value), ind);
+  }
+
+  f0r_construct_t construct = nullptr;
+  f0r_destruct_t destruct = nullptr;
+  f0r_update_t update1 = nullptr;
+  f0r_update2_t update2 = nullptr;
+  f0r_get_param_value_t get_param_value = nullptr;
+  f0r_set_param_value_t set_param_value = nullptr;
+  std::shared_ptr<RemoteWorker> remote_;
+  // shared with the plugin and its other instances
+  std::shared_ptr<const ParamDescriptors> params_;
+
+  std::map<int, bool> update_bools_;
+  std::map<int, double> update_doubles_;
+  std::map<int, double> update_color_r_;
+  std::map<int, double> update_color_g_;
+  std::map<int, double> update_color_b_;
+  std::map<int, double> update_position_x_;
+  std::map<int, double> update_position_y_;
+  std::map<int, std::string> update_string_;
+  // keyed by parameter index and which number of a color or position
+  std::map<std::pair<int, int>, ParamCurve> curves_;
+  void getValues();
+  f0r_plugin_info fi_;
+
+  // write the output straight into a caller owned width_ x height_ buffer
+  void update(const double time, uint32_t* out_frame);
+  // allocate and touch the input frames now instead of in the first updates
+  void prefaultFrames();
+  size_t numInputs() const
+  {
+    return frei0r_image::numInputs(fi_.plugin_type);
+  }
+  // TODO(lucasw) could be cv::Mat
+  std::vector<uint32_t> in_frame_;
+  // having to convert to cv::Mat eliminates some of the advantage of nodelets
+  // but at least there aren't even more copies.
+  cv::Mat image_in_[3];
+
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+};
+
+struct Plugin
+{
+  // with config.isolate the plugin is loaded in a frei0r_worker process
+  explicit Plugin(const std::string& plugin_name,
+      const WorkerConfig& config = WorkerConfig());
+  ~Plugin();
+  void print();
+  // fill params_ from the plugin or worker, only done while loading
+  void loadParams();
+  // index into params_ of the param with this name or ros_name, -1 if none
+  int findParam(const std::string& name) const;
+  size_t numInputs() const
+  {
+    return frei0r_image::numInputs(fi_.plugin_type);
+  }
+  // nullptr when ind is out of range
+  const ParamDescriptor* param(const int ind) const
+  {
+    if ((ind < 0) || (ind >= static_cast<int>(params_->size()))) {
+      return nullptr;
+    }
+    return &(*params_)[ind];
+  }
+  f0r_init_t init;
+  f0r_deinit_t deinit;
+
+  f0r_construct_t construct = nullptr;
+  f0r_destruct_t destruct = nullptr;
+  f0r_get_param_info_t get_param_info = nullptr;
+  f0r_get_param_value_t get_param_value = nullptr;
+  f0r_set_param_value_t set_param_value = nullptr;
+
+  void makeInstance(unsigned int width, unsigned int height)
+  {
+    instance_ = newInstance(width, height);
+  }
+
+  // another instance that isn't instance_, the caller owns it
+  std::unique_ptr<Instance> newInstance(unsigned int width, unsigned int height)
+  {
+    return std::make_unique<Instance>(width, height,
+        construct, destruct, update1, update2,
+        fi_, params_, get_param_value, set_param_value, remote_);
+  }
+
+  std::string plugin_name_;
+  f0r_plugin_info fi_;
+  // never changes after loading, so it is safe to read from any thread
+  std::shared_ptr<const ParamDescriptors> params_ = std::make_shared<ParamDescriptors>();
+  f0r_get_plugin_info_t get_plugin_info = nullptr;
+
+  f0r_update_t update1;
+  f0r_update2_t update2;
+
+  std::unique_ptr<Instance> instance_;
+  void* handle_ = nullptr;
+  std::shared_ptr<RemoteWorker> remote_;
+
+  const std::array<std::string, 4> plugin_types = {
+      {"filter", "source", "mixer2", "mixer3"}};
+  const std::array<std::string, 5> param_types = {
+      {"bool", "double", "color", "position", "string"}};
+  const std::array<std::string, 3> color_models = {
+      {"bgra", "rgba", "packed32"}};
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_PLUGIN_HPP
@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Keep processing threads off of cores shared with other processes and
+ * out of page faults, for rigs where frame time jitter matters.
+ */
+
+#ifndef FREI0R_IMAGE_REALTIME_HPP
+#define FREI0R_IMAGE_REALTIME_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace frei0r_image
+{
+
+struct ThreadTuning
+{
+  // cpus the threads may run on, empty leaves them wherever the scheduler likes
+  std::vector<int> cpus;
+  // SCHED_FIFO priority 1 - 99, 0 keeps the normal scheduler
+  int fifo_priority = 0;
+};
+
+// apply to the calling thread, false and a warning for whatever the
+// process isn't permitted to do
+bool tuneCurrentThread(const ThreadTuning& tuning);
+// lock every current and future page of the process into memory
+bool lockMemory();
+// touch every page so the faults happen now instead of during an update
+void prefault(void* data, const size_t size);
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_REALTIME_HPP
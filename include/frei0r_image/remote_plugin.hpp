@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Run a frei0r plugin in a separate frei0r_worker process so a plugin
+ * that hangs or crashes doesn't take the nodelet manager with it.
+ */
+
+#ifndef FREI0R_IMAGE_REMOTE_PLUGIN_HPP
+#define FREI0R_IMAGE_REMOTE_PLUGIN_HPP
+
+#include <frei0r.h>
+#include <frei0r_image/worker_protocol.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace frei0r_image
+{
+
+struct WorkerConfig
+{
+  bool isolate = false;
+  // empty finds frei0r_worker next to the frei0r_image library
+  std::string worker_path;
+  // seconds to wait on any one call before the worker is considered hung
+  double timeout = 2.0;
+  // Instances are spread over this many worker processes, each with its
+  // own socket. Calls to instances in the same process wait on each other.
+  int processes = 1;
+};
+
+// Mirrors the frei0r calls but forwards them to the worker, instances
+// are opaque f0r_instance_t handles owned by this object.
+class RemoteWorker
+{
+public:
+  RemoteWorker(const std::string& plugin_path, const WorkerConfig& config);
+  ~RemoteWorker();
+
+  const f0r_plugin_info& info() const
+  {
+    return fi_;
+  }
+  void getParamInfo(f0r_param_info_t* info, int param_index) const;
+
+  f0r_instance_t construct(unsigned int width, unsigned int height);
+  void destruct(f0r_instance_t instance);
+  void setParamValue(f0r_instance_t instance, f0r_param_t param, int param_index);
+  void getParamValue(f0r_instance_t instance, f0r_param_t param, int param_index);
+  // inputs and output that already point at frame() aren't copied
+  bool update(f0r_instance_t instance, double time,
+      const uint32_t* inframe1, const uint32_t* inframe2, const uint32_t* inframe3,
+      uint32_t* outframe);
+  // the shared memory frame for inputs 0-2 or the output
+  uint32_t* frame(f0r_instance_t instance, const int ind);
+
+private:
+  struct ParamValue
+  {
+    double values[4] = {0.0, 0.0, 0.0, 0.0};
+    std::string text;
+  };
+
+  struct Process
+  {
+    pid_t pid = -1;
+    int fd = -1;
+    // one request at a time over fd
+    std::mutex mutex;
+    // the last restart left instances unbuilt, the next update tries again
+    bool broken = false;
+  };
+
+  struct Remote
+  {
+    int32_t id;
+    Process* process = nullptr;
+    unsigned int width;
+    unsigned int height;
+    std::string shm_name;
+    size_t frame_size = 0;
+    uint8_t* frames = nullptr;
+    // replayed into the replacement worker after a restart, only touched
+    // with process->mutex held
+    std::map<int, ParamValue> params;
+    // the last value read back of each parameter that hasn't been set
+    std::map<int, ParamValue> reads;
+  };
+
+  // nullptr if instance isn't one of remotes_
+  Remote* remote(f0r_instance_t instance);
+  // the rest of these are called with process.mutex held
+  void start(Process& process);
+  void stop(Process& process);
+  // restart the worker and rebuild every instance in it and its
+  // parameters, false with process.broken set if any couldn't be
+  bool restart(Process& process);
+  bool constructRemote(const Remote& remote);
+  void setRemoteParam(const Remote& remote, const int param_index, const ParamValue& value);
+  // send a request and wait for the reply, returns false if the worker
+  // died or timed out
+  bool call(Process& process, const WorkerRequest& request, const std::string& text,
+      WorkerReply& reply, std::string& reply_text);
+
+  std::string plugin_path_;
+  WorkerConfig config_;
+  std::string worker_path_;
+
+  std::vector<std::unique_ptr<Process>> processes_;
+
+  f0r_plugin_info fi_;
+  std::string name_;
+  std::string author_;
+  std::string explanation_;
+  std::vector<f0r_param_info_t> param_infos_;
+  std::vector<std::string> param_names_;
+  std::vector<std::string> param_explanations_;
+
+  // guards next_id_ and remotes_, never held while waiting on a worker
+  // and always taken after a process mutex
+  std::mutex mutex_;
+  int32_t next_id_ = 0;
+  std::map<int32_t, std::unique_ptr<Remote>> remotes_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_REMOTE_PLUGIN_HPP
@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Source plugins only depend on time and their parameters, so their
+ * frames can be rendered on the pool before the ticks they are for.
+ */
+
+#ifndef FREI0R_IMAGE_RENDER_AHEAD_HPP
+#define FREI0R_IMAGE_RENDER_AHEAD_HPP
+
+#include <condition_variable>
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace frei0r_image
+{
+
+// Has to be owned by a shared_ptr, queued renders keep it alive until
+// they have run.
+class RenderAhead : public std::enable_shared_from_this<RenderAhead>
+{
+public:
+  // renders with its own instance of plugin, up to depth frames ahead
+  RenderAhead(Plugin& plugin, const unsigned int width, const unsigned int height,
+      const size_t depth, ThreadPool* pool);
+  ~RenderAhead();
+
+  // no more rendering ahead, returns once a render in progress is done
+  // so the plugin can be unloaded
+  void stop();
+
+  // frames rendered after this use the parameters of from, any rendered
+  // ahead with different ones are thrown away
+  void copyParams(Instance& from);
+  // the frame for time into out, rendered now if there isn't one ahead.
+  // Later ticks are expected every period seconds.
+  void update(const double time, const double period, uint32_t* out_frame);
+
+  unsigned int width_;
+  unsigned int height_;
+
+private:
+  struct Frame
+  {
+    double time = 0.0;
+    std::vector<uint32_t> data;
+  };
+
+  // queue renderNext if there is room ahead and it isn't already, call
+  // with mutex_ held
+  void schedule();
+  void renderNext();
+  // set parameters that arrived since the last render, call with
+  // render_mutex_ held
+  void applyParams();
+
+  std::unique_ptr<Instance> instance_;
+  ThreadPool* pool_;
+
+  // only one thing renders with instance_ at a time
+  std::mutex render_mutex_;
+  ParamValues applied_;
+  bool applied_valid_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // count_ rendered frames starting at read_, the slot after them is the
+  // one being rendered into
+  std::vector<Frame> ring_;
+  size_t read_ = 0;
+  size_t count_ = 0;
+  // bumped on every parameter change so stale frames can be recognized
+  uint64_t generation_ = 0;
+  ParamValues params_;
+  bool params_valid_ = false;
+  double next_time_ = 0.0;
+  double period_ = 0.0;
+  // a render is queued or running
+  bool rendering_ = false;
+  // one is running
+  bool running_ = false;
+  bool stopping_ = false;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_RENDER_AHEAD_HPP
@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * For the frei0r plugins that talk to ros: find the master and start a
+ * node on a background thread so the host's frame updates never block
+ * on the network.
+ */
+
+#ifndef FREI0R_IMAGE_ROS_CONNECTION_HPP
+#define FREI0R_IMAGE_ROS_CONNECTION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ros/master.h>
+#include <ros/ros.h>
+#include <string>
+#include <thread>
+
+namespace frei0r_image
+{
+
+class RosConnection
+{
+public:
+  // on_connect runs on the background thread with lock() held, once the
+  // node handle exists and before connected() becomes true
+  explicit RosConnection(std::function<void(ros::NodeHandle&)> on_connect) :
+    on_connect_(on_connect)
+  {
+    thread_ = std::thread(&RosConnection::run, this);
+  }
+
+  ~RosConnection()
+  {
+    stop();
+  }
+
+  // give up connecting, the node handle stays valid until destruction so
+  // whatever was set up on it can be shut down first
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(wait_mutex_);
+      running_ = false;
+    }
+    wait_cond_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // cheap enough for every frame
+  bool connected() const
+  {
+    return connected_.load(std::memory_order_acquire);
+  }
+
+  // hold this while changing anything on_connect reads
+  std::unique_lock<std::mutex> lock()
+  {
+    return std::unique_lock<std::mutex>(connect_mutex_);
+  }
+
+  // only valid once connected()
+  ros::NodeHandle& nh()
+  {
+    return *nh_;
+  }
+
+private:
+  void run()
+  {
+    // Loaded by a nodelet or any other roscpp process: use its node, which
+    // also lets same process subscribers get published pointers directly
+    // without serialization.
+    if (ros::isInitialized()) {
+      ROS_INFO_STREAM("using the host process ros node " << ros::this_node::getName());
+      connect();
+      return;
+    }
+
+    double backoff = 0.1;
+    const double max_backoff = 5.0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        if (!running_) {
+          return;
+        }
+      }
+      // a synchronous xmlrpc round trip, which is why it lives here
+      if (ros::master::check()) {
+        break;
+      }
+      std::unique_lock<std::mutex> lock(wait_mutex_);
+      wait_cond_.wait_for(lock, std::chrono::duration<double>(backoff),
+          [this] { return !running_; });
+      backoff = std::min(backoff * 2.0, max_backoff);
+    }
+
+    {
+      // several instances may be connecting at once but there is only one
+      // ros node per process
+      static std::mutex init_mutex;
+      std::lock_guard<std::mutex> lock(init_mutex);
+      if (!ros::isInitialized()) {
+        int argc = 0;
+        ros::init(argc, nullptr, "frei0r", ros::init_options::AnonymousName);
+        ROS_INFO_STREAM("initialized ros node " << ros::this_node::getName());
+      }
+    }
+
+    connect();
+  }
+
+  void connect()
+  {
+    auto lock = this->lock();
+    nh_ = std::make_unique<ros::NodeHandle>();
+    on_connect_(*nh_);
+    connected_.store(true, std::memory_order_release);
+  }
+
+  std::function<void(ros::NodeHandle&)> on_connect_;
+  std::unique_ptr<ros::NodeHandle> nh_;
+  std::atomic<bool> connected_{false};
+  std::mutex connect_mutex_;
+
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cond_;
+  bool running_ = true;
+  std::thread thread_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_ROS_CONNECTION_HPP
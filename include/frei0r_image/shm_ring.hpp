@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Ring of frames in a named posix shared memory segment, so processes on
+ * the same host only need to exchange a small ShmFrame descriptor.
+ */
+
+#ifndef FREI0R_IMAGE_SHM_RING_HPP
+#define FREI0R_IMAGE_SHM_RING_HPP
+
+#include <atomic>
+#include <cv_bridge/cv_bridge.h>
+#include <frei0r_image/ShmFrame.h>
+#include <ros/ros.h>
+#include <string>
+
+namespace frei0r_image
+{
+
+// turn a ros name like /frei0r0/frei0r into a valid shm name
+std::string shmName(const std::string& ros_name);
+
+struct ShmRingHeader
+{
+  uint32_t magic;
+  uint32_t num_slots;
+  uint64_t slot_size;
+  std::atomic<uint64_t> write_count;
+};
+
+// each slot is a seqlock: seq is odd while the writer is in the slot
+struct ShmSlotHeader
+{
+  std::atomic<uint64_t> seq;
+  uint32_t width;
+  uint32_t height;
+  uint32_t step;
+  uint32_t pad;
+};
+
+class ShmRingWriter
+{
+public:
+  // base_name is a shm name (leading slash), the segment gets a pid and
+  // generation suffix so readers can tell when it has been re-created.
+  // Segments of base_name left by processes that died are removed.
+  ShmRingWriter(const std::string& base_name, const size_t num_slots);
+  ~ShmRingWriter();
+
+  // returns a bgra8 image pointing into the next slot, the segment is
+  // re-created if the frame doesn't fit
+  cv::Mat beginWrite(const unsigned int width, const unsigned int height);
+  // release the slot to readers and fill in the descriptor
+  void endWrite(const ros::Time& stamp, ShmFrame& desc);
+
+private:
+  void create(const size_t slot_size);
+  void destroy();
+
+  std::string base_name_;
+  std::string name_;
+  size_t num_slots_;
+  unsigned int generation_ = 0;
+  size_t size_ = 0;
+  void* data_ = nullptr;
+  ShmRingHeader* header_ = nullptr;
+  // the slot between beginWrite and endWrite
+  ShmSlotHeader* slot_ = nullptr;
+  uint32_t slot_ind_ = 0;
+};
+
+class ShmRingReader
+{
+public:
+  ShmRingReader() {}
+  ~ShmRingReader();
+
+  // zero copy view of the frame in the segment, re-mapping if the descriptor
+  // names a different segment.  Returns false if the frame is already gone.
+  bool view(const ShmFrame& desc, cv::Mat& image);
+  // call after finishing with a view, false means the writer overwrote the
+  // slot in the meantime and whatever was read from it is torn
+  bool valid(const ShmFrame& desc) const;
+
+private:
+  bool open(const std::string& name);
+  void close();
+  const ShmSlotHeader* slot(const uint32_t ind) const;
+
+  std::string name_;
+  size_t size_ = 0;
+  void* data_ = nullptr;
+  const ShmRingHeader* header_ = nullptr;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_SHM_RING_HPP
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * A bounded work stealing thread pool shared by every pipeline in a
+ * Frei0rImage nodelet.
+ */
+
+#ifndef FREI0R_IMAGE_THREAD_POOL_HPP
+#define FREI0R_IMAGE_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <frei0r_image/realtime.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace frei0r_image
+{
+
+class ThreadPool
+{
+public:
+  // 0 threads uses one per core, max_queued bounds the tasks waiting
+  // across all workers, every worker starts by applying tuning
+  ThreadPool(size_t num_threads, size_t max_queued,
+      const ThreadTuning& tuning = ThreadTuning());
+  ~ThreadPool();
+
+  // Higher priority tasks run first, equal priorities run in submission
+  // order. Returns false without queueing if the pool is already full.
+  bool submit(std::function<void()> task, const int priority = 0);
+
+  // Run fn(0) to fn(count - 1) across the pool and return once all are
+  // done. The calling thread works through them too, so this is safe to
+  // call from inside a task even when every worker is busy.
+  void parallelFor(const size_t count, const std::function<void(size_t)>& fn,
+      const int priority = 0);
+
+  size_t size() const
+  {
+    return workers_.size();
+  }
+
+private:
+  struct Task
+  {
+    int priority;
+    uint64_t order;
+    std::function<void()> fn;
+  };
+
+  // kept sorted highest priority first
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void run(const size_t index);
+  // the best task from this worker's own queue, otherwise one stolen
+  // from the busiest looking other queue
+  bool pop(const size_t index, Task& task);
+  bool popFrom(Queue& queue, Task& task);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  size_t max_queued_;
+  ThreadTuning tuning_;
+  std::atomic<size_t> queued_{0};
+  std::atomic<uint64_t> next_order_{0};
+  std::atomic<size_t> next_queue_{0};
+
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cond_;
+  bool running_ = true;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_THREAD_POOL_HPP
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Run frames larger than a plugin instance should be as a grid of
+ * overlapping tiles, each with its own tile sized instance.
+ */
+
+#ifndef FREI0R_IMAGE_TILED_INSTANCE_HPP
+#define FREI0R_IMAGE_TILED_INSTANCE_HPP
+
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+class TiledInstance
+{
+public:
+  // Tiles cover at most tile_size x tile_size of the frame and see halo
+  // more pixels on each side that aren't kept, so plugins that look at
+  // neighboring pixels don't show seams. Both are rounded up to the
+  // 8 pixel alignment instances need.
+  TiledInstance(Plugin& plugin, const unsigned int width, const unsigned int height,
+      unsigned int tile_size, unsigned int halo, ThreadPool* pool);
+
+  // tiles get whatever parameter values from has that they don't have yet
+  void copyParams(Instance& from);
+  void copyParams(const ParamValues& values);
+  // like Instance::update, from full size image_in_ into a full size frame
+  void update(const double time, uint32_t* out_frame);
+
+  unsigned int width_;
+  unsigned int height_;
+  // as asked for, before rounding
+  unsigned int tile_size_;
+  // full size inputs, converted into by the caller
+  cv::Mat image_in_[3];
+
+private:
+  struct Tile
+  {
+    // the part of the frame this tile writes
+    cv::Rect core;
+    // core plus the halo, clipped to the frame
+    cv::Rect padded;
+    std::unique_ptr<Instance> instance;
+  };
+
+  // a tile's worth of inputs and output, one set per tile running at once
+  struct Scratch
+  {
+    std::vector<uint32_t> in[3];
+    std::vector<uint32_t> out;
+  };
+
+  void updateTile(Tile& tile, const double time, cv::Mat& out);
+  std::unique_ptr<Scratch> acquireScratch();
+  void releaseScratch(std::unique_ptr<Scratch> scratch);
+
+  std::vector<Tile> tiles_;
+  size_t num_inputs_ = 0;
+  size_t max_tile_pixels_ = 0;
+  ThreadPool* pool_;
+
+  std::mutex scratch_mutex_;
+  std::vector<std::unique_ptr<Scratch>> scratch_;
+
+  // what the tiles were last set to
+  ParamValues params_;
+  bool params_valid_ = false;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_TILED_INSTANCE_HPP
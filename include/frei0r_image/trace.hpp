@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Always on black box recording: every output frame and what went into it
+ * is copied into a fixed size ring in a memory mapped file, which
+ * frei0r_trace_dump turns into pngs after the fact.
+ */
+
+#ifndef FREI0R_IMAGE_TRACE_HPP
+#define FREI0R_IMAGE_TRACE_HPP
+
+#include <atomic>
+#include <frei0r_image/plugin.hpp>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+struct TraceFileHeader
+{
+  uint32_t magic;
+  uint32_t num_slots;
+  // pixel bytes in each slot
+  uint64_t slot_size;
+  uint32_t max_params;
+  uint32_t pad;
+  std::atomic<uint64_t> write_count;
+};
+
+// a seqlock like ShmSlotHeader, seq is odd while the slot is being written
+struct TraceSlotHeader
+{
+  std::atomic<uint64_t> seq;
+  // write count of the frame, to put frames back in order
+  uint64_t index;
+  double stamp;
+  double input_stamps[3];
+  float timings[4];
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_params;
+  uint32_t pad;
+  char plugin[128];
+};
+
+// what is known about a frame besides its pixels, times are seconds
+struct TraceFrame
+{
+  enum Stage
+  {
+    CONVERT = 0,
+    PARAMS,
+    RENDER,
+    PUBLISH,
+    NUM_STAGES
+  };
+  double stamp = 0.0;
+  // 0.0 for inputs that didn't get a new frame
+  double input_stamps[3] = {0.0, 0.0, 0.0};
+  float timings[NUM_STAGES] = {0.0, 0.0, 0.0, 0.0};
+  // the numbers of each parameter, strings aren't kept
+  const ParamValues* params = nullptr;
+};
+
+class TraceWriter
+{
+public:
+  // The ring is sized to fit in file_size bytes once the first frame
+  // arrives, and is laid out again if a larger one does. Throws if the
+  // file can't be created.
+  TraceWriter(const std::string& path, const size_t file_size, const bool prefault = false);
+  ~TraceWriter();
+
+  // copies into the next slot, no system calls unless the ring has to
+  // be laid out for a larger frame
+  void write(const TraceFrame& frame, const std::string& plugin, const cv::Mat& image);
+
+private:
+  void create(const size_t slot_size);
+  void destroy();
+
+  std::string path_;
+  size_t file_size_;
+  bool prefault_;
+  size_t size_ = 0;
+  void* data_ = nullptr;
+  TraceFileHeader* header_ = nullptr;
+};
+
+// a frame copied back out of the ring
+struct TraceRecord
+{
+  uint64_t index = 0;
+  double stamp = 0.0;
+  double input_stamps[3] = {0.0, 0.0, 0.0};
+  float timings[TraceFrame::NUM_STAGES] = {0.0, 0.0, 0.0, 0.0};
+  std::string plugin;
+  // three per parameter
+  std::vector<double> params;
+  cv::Mat image;
+};
+
+class TraceReader
+{
+public:
+  // throws if path isn't a trace file
+  explicit TraceReader(const std::string& path);
+  ~TraceReader();
+
+  size_t numSlots() const
+  {
+    return header_->num_slots;
+  }
+  // false if the slot is empty or was being written to
+  bool read(const size_t slot, TraceRecord& record) const;
+
+private:
+  const uint8_t* slot(const size_t ind) const;
+
+  size_t size_ = 0;
+  void* data_ = nullptr;
+  const TraceFileHeader* header_ = nullptr;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_TRACE_HPP
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Decode a video file or numbered image sequence on its own thread into a
+ * small ring of bgra frames, ahead of when they are needed.
+ */
+
+#ifndef FREI0R_IMAGE_VIDEO_READER_HPP
+#define FREI0R_IMAGE_VIDEO_READER_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace frei0r_image
+{
+
+class VideoReader
+{
+public:
+  // source is anything cv::VideoCapture opens, including printf style
+  // image sequences like frames/%04d.png. Paced hands frames out at the
+  // frame rate (fps, or the file's own if that is 0.0), otherwise every
+  // call gets the next frame as soon as it is decoded. Throws if the
+  // source can't be opened.
+  VideoReader(const std::string& source, const unsigned int width, const unsigned int height,
+      const size_t ring_size, const bool paced, const bool loop, const double fps = 0.0);
+  ~VideoReader();
+
+  // Point frame at the frame due at time (seconds), false if there
+  // isn't a new one. The frame is only valid until the next call.
+  bool next(const double time, cv::Mat& frame);
+  // frames decoded after this are converted to the new size
+  void setSize(const unsigned int width, const unsigned int height);
+  // frames skipped to keep pace since the last call
+  uint32_t takeDropped();
+
+private:
+  void run();
+  bool decode(cv::Mat& slot);
+
+  std::string source_;
+  cv::VideoCapture capture_;
+  bool paced_;
+  bool loop_;
+  double fps_ = 30.0;
+
+  // only touched by the decode thread
+  cv::Mat decoded_;
+  cv::Mat scaled_;
+  uint64_t frame_count_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // preallocated bgra frames, count_ of them starting at read_ are
+  // decoded, the first of those is handed out while held_
+  std::vector<cv::Mat> ring_;
+  std::vector<double> times_;
+  size_t read_ = 0;
+  size_t count_ = 0;
+  bool held_ = false;
+  cv::Size size_;
+  // time of the first call to next, frame times are relative to it
+  double start_ = -1.0;
+  uint32_t dropped_ = 0;
+  bool running_ = true;
+  std::thread thread_;
+};
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_VIDEO_READER_HPP
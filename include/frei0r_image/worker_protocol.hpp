@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Messages exchanged over the control socket between RemoteWorker and
+ * the frei0r_worker process, frames don't go over the socket but through
+ * a shared memory segment per instance.
+ */
+
+#ifndef FREI0R_IMAGE_WORKER_PROTOCOL_HPP
+#define FREI0R_IMAGE_WORKER_PROTOCOL_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace frei0r_image
+{
+
+enum WorkerOp : uint32_t
+{
+  WORKER_INFO = 0,
+  WORKER_PARAM_INFO,
+  WORKER_CONSTRUCT,
+  WORKER_DESTRUCT,
+  WORKER_SET_PARAM,
+  WORKER_GET_PARAM,
+  WORKER_UPDATE,
+};
+
+// each is followed by text_size bytes of text
+struct WorkerRequest
+{
+  uint32_t op;
+  int32_t id;
+  // the param index
+  int32_t index;
+  uint32_t width;
+  uint32_t height;
+  uint32_t text_size;
+  double time;
+  // bool and double use values[0], color r g b, position x y
+  double values[4];
+};
+
+struct WorkerReply
+{
+  // 0 is success
+  int32_t status;
+  // WORKER_INFO: plugin_type, color_model, frei0r_version,
+  // major_version, minor_version, num_params
+  // WORKER_PARAM_INFO: type
+  int32_t ints[6];
+  uint32_t text_size;
+  double values[4];
+};
+
+// the per instance shared memory segment holds these frames back to back
+const int worker_num_frames = 4;
+const int worker_out_frame = 3;
+
+// the fd number of the control socket and the plugin path are the arguments
+const char worker_usage[] = "frei0r_worker <socket fd> <frei0r plugin path>";
+
+}  // namespace frei0r_image
+
+#endif  // FREI0R_IMAGE_WORKER_PROTOCOL_HPP
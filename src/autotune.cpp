@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <frei0r.h>
+#include <frei0r_image/autotune.hpp>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/tiled_instance.hpp>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+namespace
+{
+// mean seconds per call after one untimed warm up, at least 3 calls
+double timeRuns(const std::function<void(double)>& run, const double budget)
+{
+  run(0.0);
+  const auto start = std::chrono::steady_clock::now();
+  size_t runs = 0;
+  double elapsed = 0.0;
+  do {
+    // as if at 25 fps, for plugins that animate
+    run((runs + 1) * 0.04);
+    ++runs;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while ((elapsed < budget) || (runs < 3));
+  return elapsed / runs;
+}
+}  // namespace
+
+std::string cpuModel()
+{
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") != 0) {
+      continue;
+    }
+    const size_t colon = line.find(": ");
+    if (colon != std::string::npos) {
+      return line.substr(colon + 2);
+    }
+  }
+  return "unknown";
+}
+
+TuningCache::TuningCache(const std::string& path) :
+  path_(path)
+{
+  read(entries_);
+  FREI0R_INFO_STREAM(entries_.size() << " tunings in '" << path_ << "'");
+}
+
+std::string TuningCache::key(const Plugin& plugin, const unsigned int width,
+    const unsigned int height)
+{
+  // the cpu doesn't change while running
+  static const std::string cpu = cpuModel();
+  std::stringstream ss;
+  ss << plugin.plugin_name_ << "|" << plugin.fi_.major_version << "." << plugin.fi_.minor_version
+      << "|" << width << "x" << height << "|" << cpu;
+  return ss.str();
+}
+
+void TuningCache::read(std::map<std::string, TuneResult>& entries) const
+{
+  // key, tab, tile size, tab, seconds
+  std::ifstream file(path_);
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t first = line.find('\t');
+    const size_t second = line.find('\t', first + 1);
+    if ((first == std::string::npos) || (second == std::string::npos)) {
+      continue;
+    }
+    TuneResult result;
+    try {
+      result.tile_size = std::stoul(line.substr(first + 1, second - first - 1));
+      result.seconds = std::stod(line.substr(second + 1));
+    } catch (std::logic_error& ex) {
+      continue;
+    }
+    entries[line.substr(0, first)] = result;
+  }
+}
+
+bool TuningCache::find(const std::string& key, TuneResult& result)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  result = it->second;
+  return true;
+}
+
+void TuningCache::store(const std::string& key, const TuneResult& result)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  read(entries_);
+  entries_[key] = result;
+
+  // replace the file in one step so a reader never sees half of it
+  const std::string tmp_path = path_ + ".tmp";
+  {
+    std::ofstream file(tmp_path);
+    for (const auto& pair : entries_) {
+      file << pair.first << "\t" << pair.second.tile_size << "\t" << pair.second.seconds << "\n";
+    }
+    if (!file) {
+      FREI0R_WARN_STREAM("couldn't write tunings to '" << tmp_path << "'");
+      return;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    FREI0R_WARN_STREAM("couldn't replace '" << path_ << "'");
+  }
+}
+
+TuneResult autotune(Plugin& plugin, const ParamValues& values, const unsigned int width,
+    const unsigned int height, const std::vector<unsigned int>& tile_sizes,
+    const unsigned int halo, ThreadPool* pool, const double budget)
+{
+  std::vector<unsigned int> candidates = {0};
+  if (pool && (plugin.fi_.plugin_type != F0R_PLUGIN_TYPE_SOURCE)) {
+    for (const auto tile_size : tile_sizes) {
+      if ((tile_size > 0) && ((tile_size < width) || (tile_size < height))) {
+        candidates.push_back(tile_size);
+      }
+    }
+  }
+
+  TuneResult best;
+  if (candidates.size() == 1) {
+    // nothing to compare
+    return best;
+  }
+
+  const size_t num_inputs = plugin.numInputs();
+  cv::Mat input(height, width, CV_8UC4);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  std::vector<uint32_t> out(width * height);
+
+  bool found = false;
+  const double each = budget / candidates.size();
+  for (const auto tile_size : candidates) {
+    double seconds = 0.0;
+    try {
+      if (tile_size == 0) {
+        auto instance = plugin.newInstance(width, height);
+        if (!instance || !instance->instance_) {
+          continue;
+        }
+        values.write(*instance);
+        for (size_t i = 0; i < num_inputs; ++i) {
+          input.copyTo(instance->image_in_[i]);
+        }
+        seconds = timeRuns([&instance, &out](const double time) {
+          instance->update(time, out.data());
+        }, each);
+      } else {
+        TiledInstance tiled(plugin, width, height, tile_size, halo, pool);
+        tiled.copyParams(values);
+        for (size_t i = 0; i < num_inputs; ++i) {
+          input.copyTo(tiled.image_in_[i]);
+        }
+        seconds = timeRuns([&tiled, &out](const double time) {
+          tiled.update(time, out.data());
+        }, each);
+      }
+    } catch (std::runtime_error& ex) {
+      FREI0R_WARN_STREAM("tile size " << tile_size << " failed: " << ex.what());
+      continue;
+    }
+    FREI0R_INFO_STREAM(plugin.plugin_name_ << " " << width << " x " << height << " tile size "
+        << tile_size << ": " << seconds * 1000.0 << " ms");
+    if (!found || (seconds < best.seconds)) {
+      best.tile_size = tile_size;
+      best.seconds = seconds;
+      found = true;
+    }
+  }
+  return best;
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,429 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <frei0r.h>
+#include <frei0r_image/builtin.hpp>
+#include <frei0r_image/plugin.hpp>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace frei0r_image
+{
+
+namespace
+{
+
+const std::string builtin_prefix = "builtin:";
+
+struct BuiltinInstance;
+// pixels bgra pixels of a and b (unused by filters) into out
+typedef void (*kernel_t)(const BuiltinInstance& instance, const uint8_t* a, const uint8_t* b,
+    uint8_t* out, const size_t pixels);
+
+struct Builtin
+{
+  const char* stem;
+  f0r_plugin_info_t info;
+  // at most one parameter, a double
+  f0r_param_info_t param;
+  double default_value;
+  kernel_t kernel;
+};
+
+struct BuiltinInstance
+{
+  const Builtin* builtin;
+  unsigned int width;
+  unsigned int height;
+  double value;
+  // value converted to what the kernel uses
+  int amount;
+};
+
+// the parameter in the fixed point form each kernel wants
+int amountOf(const std::string& stem, const double value)
+{
+  const double v = std::min(std::max(value, 0.0), 1.0);
+  if (stem == "blend") {
+    // weight of b out of 256
+    return std::lround(v * 256.0);
+  }
+  const int c = std::min(static_cast<int>(std::lround((v - 0.5) * 512.0)), 255);
+  if (stem == "contrast0r") {
+    // gain in 8.8, small enough that twice it is still a positive int16
+    return (c < 0) ? (256 + c) : std::min(65536 / (256 - c), 16383);
+  }
+  return c;
+}
+
+uint8_t clamp255(const int value)
+{
+  return std::min(std::max(value, 0), 255);
+}
+
+#ifdef __SSE2__
+inline __m128i load(const uint8_t* data)
+{
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+
+inline void store(uint8_t* data, const __m128i value)
+{
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(data), value);
+}
+
+inline __m128i alphaMask()
+{
+  return _mm_set1_epi32(0xff000000);
+}
+
+// the color channels of color with the alpha channel of alpha
+inline __m128i withAlpha(const __m128i color, const __m128i alpha)
+{
+  const __m128i mask = alphaMask();
+  return _mm_or_si128(_mm_andnot_si128(mask, color), _mm_and_si128(mask, alpha));
+}
+#endif
+
+// frei0r mixers keep the smaller of the two alphas
+inline void mixAlpha(const uint8_t* a, const uint8_t* b, uint8_t* out)
+{
+  out[3] = std::min(a[3], b[3]);
+}
+
+void blend(const BuiltinInstance& instance, const uint8_t* a, const uint8_t* b,
+    uint8_t* out, const size_t pixels)
+{
+  const int w = instance.amount;
+  // i counts pixels in the vector loop and bytes after it
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wa = _mm_set1_epi16(256 - w);
+  const __m128i wb = _mm_set1_epi16(w);
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    const __m128i vb = load(b + i * 4);
+    // at most 255 * 256, which still fits unsigned 16 bit
+    const __m128i lo = _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)), 8);
+    const __m128i hi = _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)), 8);
+    store(out + i * 4, _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (i *= 4; i < pixels * 4; ++i) {
+    out[i] = (a[i] * (256 - w) + b[i] * w) >> 8;
+  }
+}
+
+void addition(const BuiltinInstance&, const uint8_t* a, const uint8_t* b,
+    uint8_t* out, const size_t pixels)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    const __m128i vb = load(b + i * 4);
+    store(out + i * 4, withAlpha(_mm_adds_epu8(va, vb), _mm_min_epu8(va, vb)));
+  }
+#endif
+  for (; i < pixels; ++i) {
+    for (size_t c = 0; c < 3; ++c) {
+      out[i * 4 + c] = std::min(a[i * 4 + c] + b[i * 4 + c], 255);
+    }
+    mixAlpha(a + i * 4, b + i * 4, out + i * 4);
+  }
+}
+
+void multiply(const BuiltinInstance&, const uint8_t* a, const uint8_t* b,
+    uint8_t* out, const size_t pixels)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    const __m128i vb = load(b + i * 4);
+    // a * b / 255 rounded, as (t + (t >> 8)) >> 8 with t = a * b + 128
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero),
+        _mm_unpacklo_epi8(vb, zero)), half);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero),
+        _mm_unpackhi_epi8(vb, zero)), half);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    store(out + i * 4, withAlpha(_mm_packus_epi16(lo, hi), _mm_min_epu8(va, vb)));
+  }
+#endif
+  for (; i < pixels; ++i) {
+    for (size_t c = 0; c < 3; ++c) {
+      const int t = a[i * 4 + c] * b[i * 4 + c] + 128;
+      out[i * 4 + c] = (t + (t >> 8)) >> 8;
+    }
+    mixAlpha(a + i * 4, b + i * 4, out + i * 4);
+  }
+}
+
+void difference(const BuiltinInstance&, const uint8_t* a, const uint8_t* b,
+    uint8_t* out, const size_t pixels)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    const __m128i vb = load(b + i * 4);
+    const __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    store(out + i * 4, withAlpha(diff, _mm_min_epu8(va, vb)));
+  }
+#endif
+  for (; i < pixels; ++i) {
+    for (size_t c = 0; c < 3; ++c) {
+      out[i * 4 + c] = std::abs(a[i * 4 + c] - b[i * 4 + c]);
+    }
+    mixAlpha(a + i * 4, b + i * 4, out + i * 4);
+  }
+}
+
+void invert(const BuiltinInstance&, const uint8_t* a, const uint8_t*,
+    uint8_t* out, const size_t pixels)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i color = _mm_set1_epi32(0x00ffffff);
+  for (; i + 4 <= pixels; i += 4) {
+    store(out + i * 4, _mm_xor_si128(load(a + i * 4), color));
+  }
+#endif
+  for (i *= 4; i < pixels * 4; ++i) {
+    out[i] = (i % 4 == 3) ? a[i] : (255 - a[i]);
+  }
+}
+
+void brightness(const BuiltinInstance& instance, const uint8_t* a, const uint8_t*,
+    uint8_t* out, const size_t pixels)
+{
+  // darker scales towards 0, brighter moves towards 255
+  const int amount = instance.amount;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i scale = _mm_set1_epi16((amount < 0) ? (256 + amount) : amount);
+  const __m128i full = _mm_set1_epi16(256);
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    __m128i lo = _mm_unpacklo_epi8(va, zero);
+    __m128i hi = _mm_unpackhi_epi8(va, zero);
+    if (amount < 0) {
+      lo = _mm_srli_epi16(_mm_mullo_epi16(lo, scale), 8);
+      hi = _mm_srli_epi16(_mm_mullo_epi16(hi, scale), 8);
+    } else {
+      lo = _mm_add_epi16(lo, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(full, lo), scale), 8));
+      hi = _mm_add_epi16(hi, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(full, hi), scale), 8));
+    }
+    store(out + i * 4, withAlpha(_mm_packus_epi16(lo, hi), va));
+  }
+#endif
+  for (i *= 4; i < pixels * 4; ++i) {
+    if (i % 4 == 3) {
+      out[i] = a[i];
+    } else if (amount < 0) {
+      out[i] = (a[i] * (256 + amount)) >> 8;
+    } else {
+      out[i] = clamp255(a[i] + (((256 - a[i]) * amount) >> 8));
+    }
+  }
+}
+
+void contrast(const BuiltinInstance& instance, const uint8_t* a, const uint8_t*,
+    uint8_t* out, const size_t pixels)
+{
+  // scale the distance from mid gray by the 8.8 gain
+  const int gain = instance.amount;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mid = _mm_set1_epi16(128);
+  // (x - 128) << 7 times 2 * gain, high 16 bits, is (x - 128) * gain >> 8
+  const __m128i scale = _mm_set1_epi16(gain * 2);
+  for (; i + 4 <= pixels; i += 4) {
+    const __m128i va = load(a + i * 4);
+    __m128i lo = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(va, zero), mid), 7);
+    __m128i hi = _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(va, zero), mid), 7);
+    lo = _mm_add_epi16(_mm_mulhi_epi16(lo, scale), mid);
+    hi = _mm_add_epi16(_mm_mulhi_epi16(hi, scale), mid);
+    store(out + i * 4, withAlpha(_mm_packus_epi16(lo, hi), va));
+  }
+#endif
+  for (i *= 4; i < pixels * 4; ++i) {
+    if (i % 4 == 3) {
+      out[i] = a[i];
+    } else {
+      out[i] = clamp255((((a[i] - 128) * 128 * gain * 2) >> 16) + 128);
+    }
+  }
+}
+
+f0r_plugin_info_t info(const char* name, const int plugin_type, const int num_params,
+    const char* explanation)
+{
+  f0r_plugin_info_t info;
+  info.name = name;
+  info.author = "frei0r_image";
+  info.plugin_type = plugin_type;
+  info.color_model = F0R_COLOR_MODEL_RGBA8888;
+  info.frei0r_version = FREI0R_MAJOR_VERSION;
+  info.major_version = 1;
+  info.minor_version = 0;
+  info.num_params = num_params;
+  info.explanation = explanation;
+  return info;
+}
+
+const f0r_param_info_t no_param = {nullptr, 0, nullptr};
+
+// parameters and types as in the frei0r plugins of the same names
+const Builtin builtins[] = {
+  {"blend", info("blend", F0R_PLUGIN_TYPE_MIXER2, 1, "blend of two inputs"),
+      {"blend", F0R_PARAM_DOUBLE, "blend factor"}, 0.5, blend},
+  {"addition", info("addition", F0R_PLUGIN_TYPE_MIXER2, 0, "saturating sum of two inputs"),
+      no_param, 0.0, addition},
+  {"multiply", info("multiply", F0R_PLUGIN_TYPE_MIXER2, 0, "product of two inputs"),
+      no_param, 0.0, multiply},
+  {"difference", info("difference", F0R_PLUGIN_TYPE_MIXER2, 0,
+      "absolute difference of two inputs"), no_param, 0.0, difference},
+  {"invert0r", info("invert0r", F0R_PLUGIN_TYPE_FILTER, 0, "invert the colors"),
+      no_param, 0.0, invert},
+  {"brightness", info("Brightness", F0R_PLUGIN_TYPE_FILTER, 1, "adjust the brightness"),
+      {"Brightness", F0R_PARAM_DOUBLE, "The brightness value"}, 0.5, brightness},
+  {"contrast0r", info("Contrast0r", F0R_PLUGIN_TYPE_FILTER, 1, "adjust the contrast"),
+      {"Contrast", F0R_PARAM_DOUBLE, "The contrast value"}, 0.5, contrast},
+};
+const size_t num_builtins = sizeof(builtins) / sizeof(builtins[0]);
+
+// the entry points that don't take an instance need one copy per builtin
+template <size_t Index>
+void getPluginInfo(f0r_plugin_info_t* info)
+{
+  *info = builtins[Index].info;
+}
+
+template <size_t Index>
+void getParamInfo(f0r_param_info_t* info, int)
+{
+  *info = builtins[Index].param;
+}
+
+template <size_t Index>
+f0r_instance_t construct(int width, int height)
+{
+  const Builtin& builtin = builtins[Index];
+  auto instance = new BuiltinInstance{&builtin, static_cast<unsigned int>(width),
+      static_cast<unsigned int>(height), builtin.default_value, 0};
+  instance->amount = amountOf(builtin.stem, instance->value);
+  return instance;
+}
+
+int init()
+{
+  return 1;
+}
+
+void deinit()
+{
+}
+
+void destruct(f0r_instance_t instance)
+{
+  delete static_cast<BuiltinInstance*>(instance);
+}
+
+void setParamValue(f0r_instance_t instance, f0r_param_t param, int)
+{
+  auto builtin_instance = static_cast<BuiltinInstance*>(instance);
+  builtin_instance->value = *static_cast<double*>(param);
+  builtin_instance->amount = amountOf(builtin_instance->builtin->stem, builtin_instance->value);
+}
+
+void getParamValue(f0r_instance_t instance, f0r_param_t param, int)
+{
+  *static_cast<double*>(param) = static_cast<BuiltinInstance*>(instance)->value;
+}
+
+void update2(f0r_instance_t instance, double, const uint32_t* in0, const uint32_t* in1,
+    const uint32_t*, uint32_t* out)
+{
+  const auto& builtin_instance = *static_cast<BuiltinInstance*>(instance);
+  builtin_instance.builtin->kernel(builtin_instance, reinterpret_cast<const uint8_t*>(in0),
+      reinterpret_cast<const uint8_t*>(in1), reinterpret_cast<uint8_t*>(out),
+      static_cast<size_t>(builtin_instance.width) * builtin_instance.height);
+}
+
+void update1(f0r_instance_t instance, double time, const uint32_t* in, uint32_t* out)
+{
+  update2(instance, time, in, nullptr, nullptr, out);
+}
+
+template <size_t Index>
+void assign(Plugin& plugin)
+{
+  plugin.get_plugin_info = getPluginInfo<Index>;
+  plugin.get_param_info = getParamInfo<Index>;
+  plugin.construct = construct<Index>;
+}
+
+void (* const assigners[])(Plugin&) = {
+  assign<0>, assign<1>, assign<2>, assign<3>, assign<4>, assign<5>, assign<6>
+};
+static_assert(sizeof(assigners) / sizeof(assigners[0]) == sizeof(builtins) / sizeof(builtins[0]),
+    "every builtin needs an assigner");
+
+}  // namespace
+
+bool isBuiltin(const std::string& name)
+{
+  return name.compare(0, builtin_prefix.size(), builtin_prefix) == 0;
+}
+
+std::vector<std::string> builtinNames()
+{
+  std::vector<std::string> names;
+  for (const auto& builtin : builtins) {
+    names.push_back(builtin_prefix + builtin.stem);
+  }
+  return names;
+}
+
+bool loadBuiltin(const std::string& name, Plugin& plugin)
+{
+  if (!isBuiltin(name)) {
+    return false;
+  }
+  const std::string stem = name.substr(builtin_prefix.size());
+  for (size_t i = 0; i < num_builtins; ++i) {
+    if (stem != builtins[i].stem) {
+      continue;
+    }
+    assigners[i](plugin);
+    plugin.init = init;
+    plugin.deinit = deinit;
+    plugin.destruct = destruct;
+    plugin.set_param_value = setParamValue;
+    plugin.get_param_value = getParamValue;
+    plugin.update1 = update1;
+    plugin.update2 = update2;
+    return true;
+  }
+  return false;
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <frei0r_image/compress.hpp>
+#include <frei0r_image/log.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <vector>
+#ifdef FREI0R_IMAGE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+namespace frei0r_image
+{
+
+namespace
+{
+
+#ifdef FREI0R_IMAGE_TURBOJPEG
+// turbojpeg handles can't be shared between threads
+struct TurboJpeg
+{
+  TurboJpeg() :
+    handle(tjInitCompress())
+  {
+  }
+  ~TurboJpeg()
+  {
+    if (handle) {
+      tjDestroy(handle);
+    }
+  }
+  tjhandle handle;
+};
+
+bool compressTurbo(const cv::Mat& bgra, const int quality, std::vector<uint8_t>& data)
+{
+  thread_local TurboJpeg turbo;
+  if (!turbo.handle) {
+    return false;
+  }
+  unsigned char* jpeg = nullptr;
+  unsigned long size = 0;  // NOLINT(runtime/int)
+  // reads bgra as is, no conversion to bgr first
+  const int rv = tjCompress2(turbo.handle, bgra.data, bgra.cols, bgra.step, bgra.rows,
+      TJPF_BGRA, &jpeg, &size, TJSAMP_420, quality, TJFLAG_FASTDCT);
+  if (rv == 0) {
+    data.assign(jpeg, jpeg + size);
+  } else {
+    FREI0R_WARN_STREAM("turbojpeg: " << tjGetErrorStr());
+  }
+  tjFree(jpeg);
+  return rv == 0;
+}
+#endif
+
+}  // namespace
+
+bool compressFrame(const cv::Mat& bgra, const std::string& format, const int quality,
+    std::vector<uint8_t>& data)
+{
+  if (bgra.empty() || (bgra.type() != CV_8UC4)) {
+    return false;
+  }
+  std::vector<int> params;
+  std::string ext;
+  if (format == "jpeg") {
+    const int jpeg_quality = std::min(std::max(quality, 1), 100);
+#ifdef FREI0R_IMAGE_TURBOJPEG
+    return compressTurbo(bgra, jpeg_quality, data);
+#else
+    ext = ".jpg";
+    params = {cv::IMWRITE_JPEG_QUALITY, jpeg_quality};
+#endif
+  } else if (format == "png") {
+    ext = ".png";
+    params = {cv::IMWRITE_PNG_COMPRESSION, std::min(std::max(quality, 0), 9)};
+  } else {
+    FREI0R_ERROR_STREAM("unsupported compression '" << format << "'");
+    return false;
+  }
+
+  try {
+    return cv::imencode(ext, bgra, data, params);
+  } catch (cv::Exception& ex) {
+    FREI0R_WARN_STREAM("can't encode " << format << ": " << ex.what());
+    return false;
+  }
+}
+
+std::string compressedFormat(const std::string& format)
+{
+  // jpeg has no alpha, png keeps it
+  if (format == "jpeg") {
+    return "bgra8; jpeg compressed bgr8";
+  }
+  return "bgra8; png compressed bgra8";
+}
+
+}  // namespace frei0r_image
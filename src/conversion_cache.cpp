@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <cv_bridge/cv_bridge.h>
+#include <frei0r_image/conversion_cache.hpp>
+#include <memory>
+#include <opencv2/imgproc.hpp>
+#include <string>
+
+namespace frei0r_image
+{
+
+ConversionCache& ConversionCache::instance()
+{
+  static ConversionCache cache;
+  return cache;
+}
+
+void ConversionCache::prune(const std::chrono::steady_clock::time_point now)
+{
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (now - it->second->made > lifetime_) {
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+std::shared_ptr<const cv::Mat> ConversionCache::get(const sensor_msgs::ImageConstPtr& msg,
+    const std::string& encoding, const cv::Size& size)
+{
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    prune(now);
+    auto& slot = entries_[Key(msg.get(), encoding, size.width, size.height)];
+    if (!slot) {
+      slot = std::make_shared<Entry>();
+      slot->msg = msg;
+      slot->made = now;
+    }
+    entry = slot;
+  }
+
+  std::lock_guard<std::mutex> lock(entry->mutex);
+  if (entry->frame) {
+    return entry->frame;
+  }
+  // if this throws the next caller tries again
+  cv_bridge::CvImageConstPtr cv_ptr = cv_bridge::toCvShare(msg, encoding);
+  if (cv_ptr->image.size() == size) {
+    // no copy at all, the frame keeps the message it points into alive
+    entry->frame = std::shared_ptr<const cv::Mat>(new cv::Mat(cv_ptr->image),
+        [cv_ptr](const cv::Mat* frame) { delete frame; });
+  } else {
+    auto frame = std::make_shared<cv::Mat>();
+    cv::resize(cv_ptr->image, *frame, size, 0, 0, cv::INTER_LINEAR);
+    entry->frame = frame;
+  }
+  return entry->frame;
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <cstdint>
+#include <frei0r_image/downsample.hpp>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace frei0r_image
+{
+
+namespace
+{
+
+#ifdef __SSE2__
+// 4 input pixels from each row into 2 output pixels, as 16 bit channels
+inline __m128i sum4(const uint8_t* row0, const uint8_t* row1)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0));
+  const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1));
+  // vertical sums of pixels 0, 1 and 2, 3
+  const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+  const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+  // then horizontal, the low 64 bits of each hold one output pixel
+  const __m128i lo_sum = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+  const __m128i hi_sum = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+  const __m128i sum = _mm_unpacklo_epi64(lo_sum, hi_sum);
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+#endif
+
+}  // namespace
+
+void downsample2x(const cv::Mat& src, cv::Mat& dst)
+{
+  const int width = src.cols / 2;
+  const int height = src.rows / 2;
+  if ((src.type() != CV_8UC4) || (dst.type() != CV_8UC4) ||
+      (dst.cols != width) || (dst.rows != height)) {
+    throw std::runtime_error("downsample2x needs bgra and a half size destination");
+  }
+
+  for (int y = 0; y < height; ++y) {
+    const uint8_t* row0 = src.ptr<uint8_t>(y * 2);
+    const uint8_t* row1 = src.ptr<uint8_t>(y * 2 + 1);
+    uint8_t* out = dst.ptr<uint8_t>(y);
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= width; x += 4) {
+      const __m128i first = sum4(row0 + x * 8, row1 + x * 8);
+      const __m128i second = sum4(row0 + x * 8 + 16, row1 + x * 8 + 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 4), _mm_packus_epi16(first, second));
+    }
+#endif
+    for (; x < width; ++x) {
+      for (int c = 0; c < 4; ++c) {
+        const int sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] +
+            row1[x * 8 + c] + row1[x * 8 + 4 + c];
+        out[x * 4 + c] = (sum + 2) >> 2;
+      }
+    }
+  }
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,442 @@
+/**
+ * Copyright 2019 Lucas Walter
+ * Load test a running Frei0rImage: publish synthetic inputs at a sweep
+ * of rates and sizes for every plugin given, and write what comes out
+ * as a csv report that can be compared against a baseline one.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <frei0r.h>
+#include <frei0r_image/LoadPlugin.h>
+#include <frei0r_image/plugin.hpp>
+#include <map>
+#include <mutex>
+#include <ros/network.h>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sstream>
+#include <std_msgs/Float32.h>
+#include <std_msgs/UInt32.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <xmlrpcpp/XmlRpcClient.h>
+
+namespace frei0r_image
+{
+
+struct BenchCase
+{
+  std::string plugin;
+  int plugin_type = 0;
+  int width = 0;
+  int height = 0;
+  double rate = 0.0;
+};
+
+struct BenchResult
+{
+  uint32_t sent = 0;
+  uint32_t received = 0;
+  uint32_t dropped = 0;
+  uint32_t skipped = 0;
+  double output_fps = 0.0;
+  // seconds from sending the input that went into an output to the output
+  // arriving here, including time queued and frames dropped in between
+  double latency_p50 = 0.0;
+  double latency_p90 = 0.0;
+  double latency_p99 = 0.0;
+  double latency_max = 0.0;
+  // mean age of the input when it was converted
+  double input_age = 0.0;
+  // manager process cpu seconds per output frame
+  double cpu_per_frame = 0.0;
+};
+
+const char* report_header = "plugin,type,width,height,rate,sent,received,dropped,skipped,"
+    "output_fps,latency_p50,latency_p90,latency_p99,latency_max,input_age,cpu_per_frame";
+
+class Bench
+{
+public:
+  Bench() :
+    private_nh_("~")
+  {
+    private_nh_.getParam("plugins", plugins_);
+    std::vector<double> rates = {10.0, 30.0, 60.0, 120.0, 240.0};
+    private_nh_.getParam("rates", rates);
+    rates_ = rates;
+    std::vector<int> sizes = {320, 240, 640, 480, 1280, 720};
+    private_nh_.getParam("resolutions", sizes);
+    for (size_t i = 0; i + 1 < sizes.size(); i += 2) {
+      resolutions_.push_back(std::make_pair(sizes[i], sizes[i + 1]));
+    }
+    private_nh_.getParam("duration", duration_);
+    private_nh_.getParam("warmup", warmup_);
+    private_nh_.getParam("node", node_);
+    private_nh_.getParam("report", report_path_);
+    private_nh_.getParam("baseline", baseline_path_);
+    private_nh_.getParam("tolerance", tolerance_);
+
+    load_client_ = nh_.serviceClient<LoadPlugin>(node_ + "/load_plugin");
+    for (size_t i = 0; i < 3; ++i) {
+      const std::string name = "image_in" + std::to_string(i);
+      pubs_[i] = nh_.advertise<sensor_msgs::Image>(name, 3);
+    }
+    out_sub_ = nh_.subscribe("image_out", 10, &Bench::outputCallback, this);
+    age_sub_ = nh_.subscribe(node_ + "/image_in0_age", 10, &Bench::ageCallback, this);
+    dropped_sub_ = nh_.subscribe(node_ + "/image_in0_dropped", 10, &Bench::droppedCallback, this);
+    skipped_sub_ = nh_.subscribe(node_ + "/skipped_updates", 10, &Bench::skippedCallback, this);
+  }
+
+  // false if anything regressed against the baseline
+  bool run()
+  {
+    if (!load_client_.waitForExistence(ros::Duration(10.0))) {
+      ROS_ERROR_STREAM("no " << load_client_.getService());
+      return false;
+    }
+    pid_ = managerPid();
+    if (pid_ <= 0) {
+      ROS_WARN_STREAM("can't find the pid of " << node_ << ", no cpu numbers");
+    }
+
+    std::vector<std::pair<BenchCase, BenchResult>> results;
+    for (const auto& plugin : plugins_) {
+      int plugin_type = 0;
+      try {
+        plugin_type = Plugin(plugin).fi_.plugin_type;
+      } catch (std::runtime_error& ex) {
+        ROS_ERROR_STREAM(ex.what() << " '" << plugin << "', skipping it");
+        continue;
+      }
+      for (const auto& resolution : resolutions_) {
+        for (const double rate : rates_) {
+          BenchCase bench_case;
+          bench_case.plugin = plugin;
+          bench_case.plugin_type = plugin_type;
+          bench_case.width = resolution.first;
+          bench_case.height = resolution.second;
+          bench_case.rate = rate;
+          BenchResult result;
+          if (!runCase(bench_case, result)) {
+            return false;
+          }
+          results.push_back(std::make_pair(bench_case, result));
+        }
+      }
+    }
+
+    std::ofstream report(report_path_);
+    report << report_header << "\n";
+    for (const auto& pair : results) {
+      report << row(pair.first, pair.second) << "\n";
+    }
+    ROS_INFO_STREAM("wrote " << results.size() << " results to " << report_path_);
+
+    if (baseline_path_.empty()) {
+      return true;
+    }
+    return compare(results);
+  }
+
+private:
+  bool runCase(const BenchCase& bench_case, BenchResult& result)
+  {
+    // setupPlugin reads these fresh every load
+    ros::param::set(node_ + "/width", bench_case.width);
+    ros::param::set(node_ + "/height", bench_case.height);
+    LoadPlugin srv;
+    srv.request.plugin_path = bench_case.plugin;
+    if (!load_client_.call(srv) || !srv.response.success) {
+      ROS_ERROR_STREAM("couldn't load " << bench_case.plugin);
+      return false;
+    }
+
+    const size_t num_inputs = numInputs(bench_case.plugin_type);
+
+    sensor_msgs::Image image;
+    image.encoding = "bgra8";
+    image.width = bench_case.width;
+    image.height = bench_case.height;
+    image.step = image.width * 4;
+    image.data.resize(image.step * image.height);
+
+    ros::Rate rate(bench_case.rate);
+    uint32_t sent = 0;
+    const ros::WallTime warm_end = ros::WallTime::now() + ros::WallDuration(warmup_);
+    ros::WallTime end;
+    double cpu_start = 0.0;
+    bool measuring = false;
+    while (ros::ok()) {
+      const ros::WallTime now = ros::WallTime::now();
+      if (!measuring && (now >= warm_end)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        latencies_.clear();
+        ages_.clear();
+        has_age_ = false;
+        input_stamp_ = ros::Time();
+        dropped_start_ = dropped_;
+        skipped_start_ = skipped_;
+        cpu_start = cpuSeconds();
+        end = now + ros::WallDuration(duration_);
+        measuring = true;
+      }
+      if (measuring && (now >= end)) {
+        break;
+      }
+
+      // a moving ramp so the frames aren't all the same
+      const uint8_t value = sent;
+      image.header.stamp = ros::Time::now();
+      for (size_t i = 0; i < num_inputs; ++i) {
+        sensor_msgs::ImagePtr msg(new sensor_msgs::Image(image));
+        std::fill(msg->data.begin(), msg->data.begin() + msg->step, value);
+        pubs_[i].publish(msg);
+      }
+      if (measuring) {
+        ++sent;
+      }
+      rate.sleep();
+    }
+    const double cpu = cpuSeconds() - cpu_start;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    result.sent = sent;
+    result.received = latencies_.size();
+    result.dropped = dropped_ - dropped_start_;
+    result.skipped = skipped_ - skipped_start_;
+    result.output_fps = result.received / duration_;
+    std::sort(latencies_.begin(), latencies_.end());
+    auto percentile = [this](const double fraction) {
+      if (latencies_.empty()) {
+        return 0.0;
+      }
+      return latencies_[std::min(static_cast<size_t>(fraction * latencies_.size()),
+          latencies_.size() - 1)];
+    };
+    result.latency_p50 = percentile(0.5);
+    result.latency_p90 = percentile(0.9);
+    result.latency_p99 = percentile(0.99);
+    result.latency_max = latencies_.empty() ? 0.0 : latencies_.back();
+    for (const double age : ages_) {
+      result.input_age += age / ages_.size();
+    }
+    if ((pid_ > 0) && (result.received > 0)) {
+      result.cpu_per_frame = cpu / result.received;
+    }
+    ROS_INFO_STREAM(row(bench_case, result));
+    return true;
+  }
+
+  std::string row(const BenchCase& bench_case, const BenchResult& result) const
+  {
+    std::stringstream ss;
+    ss << bench_case.plugin << "," << bench_case.plugin_type << ","
+        << bench_case.width << "," << bench_case.height << "," << bench_case.rate << ","
+        << result.sent << "," << result.received << "," << result.dropped << ","
+        << result.skipped << "," << result.output_fps << ","
+        << result.latency_p50 << "," << result.latency_p90 << ","
+        << result.latency_p99 << "," << result.latency_max << ","
+        << result.input_age << "," << result.cpu_per_frame;
+    return ss.str();
+  }
+
+  // Flags cases that got slower or put out fewer frames than the baseline
+  // by more than tolerance_, cases missing from either side are ignored.
+  bool compare(const std::vector<std::pair<BenchCase, BenchResult>>& results)
+  {
+    std::ifstream baseline(baseline_path_);
+    if (!baseline) {
+      ROS_ERROR_STREAM("can't read baseline " << baseline_path_);
+      return false;
+    }
+    std::map<std::string, std::vector<double>> expected;
+    std::string line;
+    std::getline(baseline, line);
+    while (std::getline(baseline, line)) {
+      std::stringstream ss(line);
+      std::vector<std::string> fields;
+      std::string field;
+      while (std::getline(ss, field, ',')) {
+        fields.push_back(field);
+      }
+      if (fields.size() != 16) {
+        continue;
+      }
+      const std::string key = fields[0] + "," + fields[2] + "," + fields[3] + "," + fields[4];
+      expected[key] = {std::stod(fields[9]), std::stod(fields[12]), std::stod(fields[15])};
+    }
+
+    bool ok = true;
+    for (const auto& pair : results) {
+      const BenchCase& bench_case = pair.first;
+      const BenchResult& result = pair.second;
+      std::stringstream key;
+      key << bench_case.plugin << "," << bench_case.width << "," << bench_case.height << ","
+          << bench_case.rate;
+      if (expected.count(key.str()) == 0) {
+        continue;
+      }
+      const std::vector<double>& base = expected[key.str()];
+      if (result.output_fps < base[0] * (1.0 - tolerance_)) {
+        ROS_ERROR_STREAM(key.str() << " output fps " << result.output_fps << " < " << base[0]);
+        ok = false;
+      }
+      if (result.latency_p99 > base[1] * (1.0 + tolerance_)) {
+        ROS_ERROR_STREAM(key.str() << " p99 latency " << result.latency_p99 << " > " << base[1]);
+        ok = false;
+      }
+      if ((base[2] > 0.0) && (result.cpu_per_frame > base[2] * (1.0 + tolerance_))) {
+        ROS_ERROR_STREAM(key.str() << " cpu per frame " << result.cpu_per_frame
+            << " > " << base[2]);
+        ok = false;
+      }
+    }
+    ROS_INFO_STREAM((ok ? "no regressions" : "regressions") << " against " << baseline_path_);
+    return ok;
+  }
+
+  // the process the nodelet runs in, from the slave api of its manager
+  int managerPid()
+  {
+    std::string manager;
+    if (!private_nh_.getParam("manager", manager)) {
+      return -1;
+    }
+    XmlRpc::XmlRpcValue args;
+    XmlRpc::XmlRpcValue result;
+    XmlRpc::XmlRpcValue payload;
+    args[0] = ros::this_node::getName();
+    args[1] = manager;
+    if (!ros::master::execute("lookupNode", args, result, payload, true)) {
+      return -1;
+    }
+    std::string host;
+    uint32_t port = 0;
+    if (!ros::network::splitURI(static_cast<std::string>(payload), host, port)) {
+      return -1;
+    }
+    XmlRpc::XmlRpcClient client(host.c_str(), port, "/");
+    XmlRpc::XmlRpcValue pid_args;
+    pid_args[0] = ros::this_node::getName();
+    if (!client.execute("getPid", pid_args, result) || (result.size() < 3)) {
+      return -1;
+    }
+    return static_cast<int>(result[2]);
+  }
+
+  // user plus system time of the manager process
+  double cpuSeconds() const
+  {
+    if (pid_ <= 0) {
+      return 0.0;
+    }
+    std::ifstream stat("/proc/" + std::to_string(pid_) + "/stat");
+    std::string text;
+    std::getline(stat, text);
+    // the command name can have spaces, the fields after it don't
+    const size_t paren = text.rfind(')');
+    if (paren == std::string::npos) {
+      return 0.0;
+    }
+    std::stringstream ss(text.substr(paren + 2));
+    std::string field;
+    double utime = 0.0;
+    double stime = 0.0;
+    // utime and stime are fields 14 and 15, the 12th and 13th after the name
+    for (int i = 0; i < 13; ++i) {
+      ss >> field;
+      if (i == 11) {
+        utime = std::stod(field);
+      } else if (i == 12) {
+        stime = std::stod(field);
+      }
+    }
+    return (utime + stime) / sysconf(_SC_CLK_TCK);
+  }
+
+  void outputCallback(const sensor_msgs::ImageConstPtr& msg)
+  {
+    const ros::Time now = ros::Time::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The output is stamped with its update tick, and the node reports the
+    // age of the input it converted in that update just before publishing.
+    // Updates without a new input show the last one, so that one ages on.
+    if (has_age_) {
+      input_stamp_ = msg->header.stamp - ros::Duration(age_);
+      has_age_ = false;
+    }
+    // sources have no input, only the tick to here part is there
+    const ros::Time start = input_stamp_.isZero() ? msg->header.stamp : input_stamp_;
+    latencies_.push_back((now - start).toSec());
+  }
+
+  void ageCallback(const std_msgs::Float32ConstPtr& msg)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ages_.push_back(msg->data);
+    age_ = msg->data;
+    has_age_ = true;
+  }
+
+  void droppedCallback(const std_msgs::UInt32ConstPtr& msg)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropped_ = msg->data;
+  }
+
+  void skippedCallback(const std_msgs::UInt32ConstPtr& msg)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    skipped_ = msg->data;
+  }
+
+  ros::NodeHandle nh_;
+  ros::NodeHandle private_nh_;
+  std::vector<std::string> plugins_;
+  std::vector<double> rates_;
+  std::vector<std::pair<int, int>> resolutions_;
+  double duration_ = 5.0;
+  double warmup_ = 1.0;
+  std::string node_ = "frei0r";
+  std::string report_path_ = "frei0r_bench.csv";
+  std::string baseline_path_;
+  double tolerance_ = 0.2;
+  int pid_ = -1;
+
+  ros::ServiceClient load_client_;
+  ros::Publisher pubs_[3];
+  ros::Subscriber out_sub_;
+  ros::Subscriber age_sub_;
+  ros::Subscriber dropped_sub_;
+  ros::Subscriber skipped_sub_;
+
+  std::mutex mutex_;
+  std::vector<double> latencies_;
+  std::vector<double> ages_;
+  // the newest age not yet matched to an output, and the send stamp of the
+  // input in the newest output
+  double age_ = 0.0;
+  bool has_age_ = false;
+  ros::Time input_stamp_;
+  uint32_t dropped_ = 0;
+  uint32_t dropped_start_ = 0;
+  uint32_t skipped_ = 0;
+  uint32_t skipped_start_ = 0;
+};
+
+}  // namespace frei0r_image
+
+int main(int argn, char* argv[])
+{
+  ros::init(argn, argv, "frei0r_bench");
+  // subscribers keep up while the main thread publishes
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+  frei0r_image::Bench bench;
+  const bool ok = bench.run();
+  ros::shutdown();
+  return ok ? 0 : 1;
+}
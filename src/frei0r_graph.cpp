@@ -0,0 +1,462 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cv_bridge/cv_bridge.h>
+#include <deque>
+#include <exception>
+#include <frei0r.h>
+#include <frei0r_image/conversion_cache.hpp>
+#include <frei0r_image/frei0r_graph.hpp>
+#include <frei0r_image/frei0r_image.hpp>
+#include <limits>
+#include <map>
+#include <memory>
+#include <nodelet/nodelet.h>
+#include <opencv2/imgproc.hpp>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <std_msgs/Header.h>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+namespace
+{
+double toDouble(XmlRpc::XmlRpcValue& value)
+{
+  switch (value.getType()) {
+    case (XmlRpc::XmlRpcValue::TypeBoolean):
+      return static_cast<bool&>(value) ? 1.0 : 0.0;
+    case (XmlRpc::XmlRpcValue::TypeInt):
+      return static_cast<int&>(value);
+    case (XmlRpc::XmlRpcValue::TypeDouble):
+      return static_cast<double&>(value);
+    default:
+      throw std::runtime_error("expected a number");
+  }
+}
+}  // namespace
+
+Frei0rGraph::Frei0rGraph()
+{
+}
+
+Frei0rGraph::~Frei0rGraph()
+{
+  timer_.stop();
+  for (auto& node : nodes_) {
+    node->sub.shutdown();
+  }
+  pool_ = nullptr;
+  nodes_.clear();
+}
+
+void Frei0rGraph::onInit()
+{
+  setRosLogHandler();
+  int width = width_;
+  getPrivateNodeHandle().getParam("width", width);
+  int height = height_;
+  getPrivateNodeHandle().getParam("height", height);
+  width_ = std::max(width, 8);
+  height_ = std::max(height, 8);
+  adjustWidthHeight(width_, height_);
+
+  XmlRpc::XmlRpcValue graph;
+  if (!getPrivateNodeHandle().getParam("graph", graph)) {
+    ROS_ERROR_STREAM("no ~graph description to run");
+    return;
+  }
+  try {
+    load(graph);
+  } catch (std::runtime_error& ex) {
+    ROS_ERROR_STREAM("bad graph: " << ex.what());
+    for (auto& node : nodes_) {
+      node->sub.shutdown();
+    }
+    nodes_.clear();
+    buffers_.clear();
+    return;
+  }
+
+  int num_threads = 0;
+  getPrivateNodeHandle().getParam("num_threads", num_threads);
+  // anything that doesn't fit runs on the thread that readied it
+  pool_ = std::make_unique<ThreadPool>(std::max(num_threads, 0), nodes_.size(),
+      getThreadTuning(getPrivateNodeHandle()));
+
+  double update_period = 0.1;
+  getPrivateNodeHandle().getParam("update_period", update_period);
+  timer_ = getPrivateNodeHandle().createTimer(ros::Duration(update_period),
+      &Frei0rGraph::update, this);
+}
+
+void Frei0rGraph::load(XmlRpc::XmlRpcValue& graph)
+{
+  if ((graph.getType() != XmlRpc::XmlRpcValue::TypeStruct) || !graph.hasMember("nodes") ||
+      (graph["nodes"].getType() != XmlRpc::XmlRpcValue::TypeStruct)) {
+    throw std::runtime_error("the graph needs a map of nodes");
+  }
+  XmlRpc::XmlRpcValue& nodes = graph["nodes"];
+
+  std::map<std::string, size_t> indices;
+  for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+    indices[it->first] = nodes_.size();
+    nodes_.push_back(std::make_unique<GraphNode>());
+    nodes_.back()->name = it->first;
+  }
+
+  size_t index = 0;
+  for (auto it = nodes.begin(); it != nodes.end(); ++it, ++index) {
+    GraphNode& node = *nodes_[index];
+    XmlRpc::XmlRpcValue& desc = it->second;
+    if (desc.getType() != XmlRpc::XmlRpcValue::TypeStruct) {
+      throw std::runtime_error("node '" + node.name + "' isn't a map");
+    }
+
+    size_t num_inputs = 0;
+    if (desc.hasMember("topic")) {
+      const std::string topic = static_cast<std::string&>(desc["topic"]);
+      // keeps its last frame until a new one arrives
+      node.dedicated = true;
+      // 2 so a frame arriving while the previous callback is queued isn't lost
+      node.sub = getNodeHandle().subscribe<sensor_msgs::Image>(topic, 2,
+          boost::bind(&Frei0rGraph::imageCallback, this, _1, index));
+    } else if (desc.hasMember("plugin")) {
+      const std::string plugin_name = static_cast<std::string&>(desc["plugin"]);
+      try {
+        node.plugin = std::make_unique<Plugin>(plugin_name);
+      } catch (std::runtime_error& ex) {
+        throw std::runtime_error("node '" + node.name + "' " + ex.what() + " '" + plugin_name + "'");
+      }
+      node.plugin->makeInstance(width_, height_);
+      if (!node.plugin->instance_) {
+        throw std::runtime_error("no instance for node '" + node.name + "'");
+      }
+      num_inputs = node.plugin->numInputs();
+    } else {
+      throw std::runtime_error("node '" + node.name + "' needs a plugin or a topic");
+    }
+
+    if (desc.hasMember("inputs")) {
+      XmlRpc::XmlRpcValue& inputs = desc["inputs"];
+      if (inputs.getType() != XmlRpc::XmlRpcValue::TypeArray) {
+        throw std::runtime_error("inputs of node '" + node.name + "' aren't a list");
+      }
+      for (int i = 0; i < inputs.size(); ++i) {
+        // either a node name or {node: name, feedback: true}
+        XmlRpc::XmlRpcValue& input = inputs[i];
+        std::string source;
+        bool feedback = false;
+        if (input.getType() == XmlRpc::XmlRpcValue::TypeString) {
+          source = static_cast<std::string&>(input);
+        } else if ((input.getType() == XmlRpc::XmlRpcValue::TypeStruct) && input.hasMember("node")) {
+          source = static_cast<std::string&>(input["node"]);
+          if (input.hasMember("feedback")) {
+            feedback = static_cast<bool&>(input["feedback"]);
+          }
+        } else {
+          throw std::runtime_error("bad input " + std::to_string(i) + " on node '" + node.name + "'");
+        }
+        if (indices.count(source) == 0) {
+          throw std::runtime_error("node '" + node.name + "' has unknown input '" + source + "'");
+        }
+        node.inputs.push_back(indices[source]);
+        node.feedback.push_back(feedback);
+      }
+    }
+    if (node.inputs.size() != num_inputs) {
+      throw std::runtime_error("node '" + node.name + "' needs " + std::to_string(num_inputs)
+          + " inputs, not " + std::to_string(node.inputs.size()));
+    }
+
+    if (desc.hasMember("params")) {
+      setParams(node, desc["params"]);
+    }
+
+    if (desc.hasMember("publish") && static_cast<bool&>(desc["publish"])) {
+      // published after the update finishes so can't share its buffer
+      node.publish = true;
+      node.dedicated = true;
+      node.pub = getNodeHandle().advertise<sensor_msgs::Image>(node.name, 3);
+    }
+  }
+
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    GraphNode& node = *nodes_[i];
+    for (size_t j = 0; j < node.inputs.size(); ++j) {
+      GraphNode& source = *nodes_[node.inputs[j]];
+      if (node.feedback[j]) {
+        // a topic node only ever writes its first buffer, and what it
+        // holds doesn't depend on this frame anyway
+        if (!source.plugin) {
+          throw std::runtime_error("node '" + node.name + "' can't take topic node '"
+              + source.name + "' as feedback, use it as a plain input");
+        }
+        source.feedback_source = true;
+        source.dedicated = true;
+        continue;
+      }
+      source.dependents.push_back(i);
+      ++node.num_deps;
+    }
+  }
+
+  sortNodes();
+  assignBuffers();
+}
+
+void Frei0rGraph::setParams(GraphNode& node, XmlRpc::XmlRpcValue& params)
+{
+  if (!node.plugin || (params.getType() != XmlRpc::XmlRpcValue::TypeStruct)) {
+    throw std::runtime_error("params of node '" + node.name + "' need a plugin and a map");
+  }
+  Instance& instance = *node.plugin->instance_;
+  for (auto it = params.begin(); it != params.end(); ++it) {
+    // either the plugin's name for the param or the sanitized ddr one
+    const int ind = node.plugin->findParam(it->first);
+    if (ind < 0) {
+      throw std::runtime_error("node '" + node.name + "' has no param '" + it->first + "'");
+    }
+
+    XmlRpc::XmlRpcValue& value = it->second;
+    switch (node.plugin->param(ind)->type) {
+      case (F0R_PARAM_BOOL): {
+        instance.setParamValue(toDouble(value) > 0.5, ind);
+        break;
+      }
+      case (F0R_PARAM_DOUBLE): {
+        instance.setParamValue(toDouble(value), ind);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        if ((value.getType() != XmlRpc::XmlRpcValue::TypeArray) || (value.size() != 3)) {
+          throw std::runtime_error("color '" + it->first + "' needs [r, g, b]");
+        }
+        f0r_param_color_t color;
+        color.r = toDouble(value[0]);
+        color.g = toDouble(value[1]);
+        color.b = toDouble(value[2]);
+        instance.setParam(reinterpret_cast<f0r_param_t>(&color), ind);
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        if ((value.getType() != XmlRpc::XmlRpcValue::TypeArray) || (value.size() != 2)) {
+          throw std::runtime_error("position '" + it->first + "' needs [x, y]");
+        }
+        f0r_param_position_t pos;
+        pos.x = toDouble(value[0]);
+        pos.y = toDouble(value[1]);
+        instance.setParam(reinterpret_cast<f0r_param_t>(&pos), ind);
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        instance.setString(static_cast<std::string&>(value), ind);
+        break;
+      }
+    }
+  }
+}
+
+void Frei0rGraph::sortNodes()
+{
+  std::vector<size_t> deps_left(nodes_.size());
+  std::deque<size_t> ready;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    deps_left[i] = nodes_[i]->num_deps;
+    if (deps_left[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+  order_.clear();
+  while (!ready.empty()) {
+    const size_t index = ready.front();
+    ready.pop_front();
+    order_.push_back(index);
+    for (const size_t dependent : nodes_[index]->dependents) {
+      if (--deps_left[dependent] == 0) {
+        ready.push_back(dependent);
+      }
+    }
+  }
+  if (order_.size() != nodes_.size()) {
+    throw std::runtime_error("the graph has a cycle, mark one of its inputs as feedback");
+  }
+}
+
+void Frei0rGraph::assignBuffers()
+{
+  const size_t num = nodes_.size();
+  // ancestors[n][a] when a always finishes before n starts within an update
+  std::vector<std::vector<bool>> ancestors(num, std::vector<bool>(num, false));
+  for (const size_t index : order_) {
+    const GraphNode& node = *nodes_[index];
+    for (size_t j = 0; j < node.inputs.size(); ++j) {
+      if (node.feedback[j]) {
+        continue;
+      }
+      const size_t source = node.inputs[j];
+      ancestors[index][source] = true;
+      for (size_t a = 0; a < num; ++a) {
+        if (ancestors[source][a]) {
+          ancestors[index][a] = true;
+        }
+      }
+    }
+  }
+
+  // the node that last wrote each buffer, none for dedicated ones
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::vector<size_t> owners;
+  buffers_.clear();
+  for (const size_t index : order_) {
+    GraphNode& node = *nodes_[index];
+    const size_t count = node.feedback_source ? 2 : 1;
+    for (size_t k = 0; k < count; ++k) {
+      int buffer = -1;
+      // a buffer is dead once its writer and every reader of it are done
+      // before this node can start, which holds in any schedule
+      for (size_t b = 0; !node.dedicated && (b < owners.size()); ++b) {
+        const size_t owner = owners[b];
+        if ((owner == none) || !ancestors[index][owner]) {
+          continue;
+        }
+        const auto& readers = nodes_[owner]->dependents;
+        if (std::all_of(readers.begin(), readers.end(),
+            [&](const size_t reader) { return ancestors[index][reader]; })) {
+          buffer = b;
+          owners[b] = index;
+          break;
+        }
+      }
+      if (buffer < 0) {
+        buffer = buffers_.size();
+        buffers_.push_back(cv::Mat(height_, width_, CV_8UC4, cv::Scalar(0, 0, 0, 0)));
+        owners.push_back(node.dedicated ? none : index);
+      }
+      node.buffers[k] = buffer;
+    }
+  }
+  ROS_INFO_STREAM(num << " graph nodes share " << buffers_.size() << " "
+      << width_ << " x " << height_ << " buffers");
+}
+
+uint32_t* Frei0rGraph::output(const GraphNode& node)
+{
+  const int buffer = node.buffers[node.feedback_source ? (frame_ % 2) : 0];
+  return buffers_[buffer].ptr<uint32_t>();
+}
+
+const uint32_t* Frei0rGraph::input(const GraphNode& node, const size_t ind)
+{
+  const GraphNode& source = *nodes_[node.inputs[ind]];
+  if (node.feedback[ind]) {
+    // what the source wrote on the previous update, black on the first
+    return buffers_[source.buffers[(frame_ + 1) % 2]].ptr<uint32_t>();
+  }
+  return output(source);
+}
+
+void Frei0rGraph::imageCallback(const sensor_msgs::ImageConstPtr& msg, const size_t index)
+{
+  GraphNode& node = *nodes_[index];
+  std::lock_guard<std::mutex> lock(node.input_mutex);
+  node.pending = msg;
+}
+
+void Frei0rGraph::schedule(const size_t index)
+{
+  if (!pool_->submit([this, index]() { runNode(index); })) {
+    runNode(index);
+  }
+}
+
+void Frei0rGraph::runNode(const size_t index)
+{
+  GraphNode& node = *nodes_[index];
+  try {
+    if (!node.plugin) {
+      sensor_msgs::ImageConstPtr msg;
+      {
+        std::lock_guard<std::mutex> lock(node.input_mutex);
+        msg = node.pending;
+        node.pending = nullptr;
+      }
+      if (msg) {
+        auto frame = ConversionCache::instance().get(msg, "bgra8", cv::Size(width_, height_));
+        frame->copyTo(buffers_[node.buffers[0]]);
+      }
+    } else {
+      const uint32_t* in[3] = {nullptr, nullptr, nullptr};
+      for (size_t i = 0; i < node.inputs.size(); ++i) {
+        in[i] = input(node, i);
+      }
+      node.plugin->instance_->process(time_, in[0], in[1], in[2], output(node));
+    }
+  } catch (cv_bridge::Exception& ex) {
+    ROS_ERROR_STREAM_THROTTLE(1.0, node.name << " cv bridge exception " << ex.what());
+  } catch (std::exception& ex) {
+    // cv::Exception and bad_alloc too, the bookkeeping below has to run
+    // or update waits forever
+    ROS_ERROR_STREAM_THROTTLE(1.0, node.name << " " << ex.what());
+  }
+
+  std::vector<size_t> ready;
+  {
+    std::lock_guard<std::mutex> lock(run_mutex_);
+    for (const size_t dependent : node.dependents) {
+      if (--nodes_[dependent]->deps_left == 0) {
+        ready.push_back(dependent);
+      }
+    }
+    --remaining_;
+  }
+  run_cond_.notify_all();
+  for (const size_t dependent : ready) {
+    schedule(dependent);
+  }
+}
+
+void Frei0rGraph::update(const ros::TimerEvent& event)
+{
+  if (nodes_.empty()) {
+    return;
+  }
+  time_ = event.current_real.toSec();
+  {
+    std::lock_guard<std::mutex> lock(run_mutex_);
+    remaining_ = nodes_.size();
+    for (auto& node : nodes_) {
+      node->deps_left = node->num_deps;
+    }
+  }
+  for (const size_t index : order_) {
+    if (nodes_[index]->num_deps == 0) {
+      schedule(index);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(run_mutex_);
+    run_cond_.wait(lock, [this] { return remaining_ == 0; });
+  }
+
+  std_msgs::Header header;
+  header.stamp = event.current_real;
+  for (auto& node : nodes_) {
+    if (!node->publish || (node->pub.getNumSubscribers() == 0)) {
+      continue;
+    }
+    node->pub.publish(cv_bridge::CvImage(header, "bgra8",
+        buffers_[node->buffers[node->feedback_source ? (frame_ % 2) : 0]]).toImageMsg());
+  }
+  ++frame_;
+}
+
+}  // namespace frei0r_image
+
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_EXPORT_CLASS(frei0r_image::Frei0rGraph, nodelet::Nodelet)
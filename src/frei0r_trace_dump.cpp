@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Write the frames of a ~trace_file ring, or the ones in a time window,
+ * out as pngs with a csv of their stamps, stage timings and parameters.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <frei0r_image/trace.hpp>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+const char* usage = "frei0r_trace_dump <trace file> <output dir> [seconds | start end]\n"
+    "  seconds: only the frames that many seconds before the newest one\n"
+    "  start end: only the frames stamped between these (seconds since the epoch)";
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  if ((argc < 3) || (argc > 5)) {
+    std::cerr << usage << "\n";
+    return 1;
+  }
+  const std::string output_dir = argv[2];
+
+  std::vector<frei0r_image::TraceRecord> records;
+  try {
+    frei0r_image::TraceReader reader(argv[1]);
+    for (size_t i = 0; i < reader.numSlots(); ++i) {
+      frei0r_image::TraceRecord record;
+      if (reader.read(i, record)) {
+        records.push_back(record);
+      }
+    }
+  } catch (std::runtime_error& ex) {
+    std::cerr << ex.what() << "\n";
+    return 2;
+  }
+  if (records.empty()) {
+    std::cerr << "no frames in '" << argv[1] << "'\n";
+    return 2;
+  }
+  std::sort(records.begin(), records.end(),
+      [](const frei0r_image::TraceRecord& a, const frei0r_image::TraceRecord& b) {
+        return a.index < b.index;
+      });
+
+  double start = records.front().stamp;
+  double end = records.back().stamp;
+  if (argc == 4) {
+    start = end - std::atof(argv[3]);
+  } else if (argc == 5) {
+    start = std::atof(argv[3]);
+    end = std::atof(argv[4]);
+  }
+
+  std::experimental::filesystem::create_directories(output_dir);
+  std::ofstream csv(output_dir + "/trace.csv");
+  csv << "index,stamp,input0,input1,input2,convert,params,render,publish,plugin,params\n";
+  csv << std::fixed << std::setprecision(6);
+  size_t count = 0;
+  for (const auto& record : records) {
+    if ((record.stamp < start) || (record.stamp > end)) {
+      continue;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%08lu.png", static_cast<unsigned long>(record.index));
+    if (!cv::imwrite(output_dir + "/" + name, record.image)) {
+      std::cerr << "couldn't write " << name << "\n";
+    }
+    csv << record.index << "," << record.stamp;
+    for (const double input_stamp : record.input_stamps) {
+      csv << "," << input_stamp;
+    }
+    for (const float timing : record.timings) {
+      csv << "," << timing;
+    }
+    csv << "," << record.plugin << ",";
+    for (size_t i = 0; i < record.params.size(); ++i) {
+      csv << (i > 0 ? " " : "") << record.params[i];
+    }
+    csv << "\n";
+    ++count;
+  }
+  std::cout << "wrote " << count << " of " << records.size() << " frames to " << output_dir
+      << "\n";
+  return 0;
+}
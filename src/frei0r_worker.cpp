@@ -0,0 +1,313 @@
+/**
+ * Copyright 2019 Lucas Walter
+ * Host a single frei0r plugin for RemoteWorker, see worker_protocol.hpp
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <frei0r.h>
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/worker_protocol.hpp>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+
+bool readAll(const int fd, void* data, size_t size)
+{
+  auto bytes = static_cast<uint8_t*>(data);
+  while (size > 0) {
+    const ssize_t rv = recv(fd, bytes, size, 0);
+    if (rv <= 0) {
+      if ((rv < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return false;
+    }
+    bytes += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+bool writeAll(const int fd, const void* data, size_t size)
+{
+  auto bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    const ssize_t rv = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+struct Local
+{
+  f0r_instance_t instance = nullptr;
+  uint8_t* frames = nullptr;
+  size_t frame_size = 0;
+};
+
+struct Worker
+{
+  explicit Worker(const std::string& plugin_path) :
+    plugin_(plugin_path)
+  {
+  }
+
+  ~Worker()
+  {
+    for (auto& pair : locals_) {
+      release(pair.second);
+    }
+  }
+
+  void release(Local& local)
+  {
+    if (local.instance) {
+      plugin_.destruct(local.instance);
+    }
+    if (local.frames) {
+      munmap(local.frames, local.frame_size * frei0r_image::worker_num_frames);
+    }
+  }
+
+  bool construct(const frei0r_image::WorkerRequest& request, const std::string& shm_name)
+  {
+    if (locals_.count(request.id) > 0) {
+      release(locals_[request.id]);
+      locals_.erase(request.id);
+    }
+    Local local;
+    local.frame_size = request.width * request.height * 4;
+    const size_t size = local.frame_size * frei0r_image::worker_num_frames;
+    const int fd = shm_open(shm_name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      return false;
+    }
+    void* frames = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (frames == MAP_FAILED) {
+      return false;
+    }
+    local.frames = static_cast<uint8_t*>(frames);
+    local.instance = plugin_.construct(request.width, request.height);
+    if (!local.instance) {
+      release(local);
+      return false;
+    }
+    locals_[request.id] = local;
+    return true;
+  }
+
+  int32_t handle(const frei0r_image::WorkerRequest& request, const std::string& text,
+      frei0r_image::WorkerReply& reply, std::string& reply_text)
+  {
+    const f0r_plugin_info& fi = plugin_.fi_;
+    switch (request.op) {
+      case (frei0r_image::WORKER_INFO): {
+        reply.ints[0] = fi.plugin_type;
+        reply.ints[1] = fi.color_model;
+        reply.ints[2] = fi.frei0r_version;
+        reply.ints[3] = fi.major_version;
+        reply.ints[4] = fi.minor_version;
+        reply.ints[5] = fi.num_params;
+        reply_text = std::string(fi.name) + '\0' + fi.author + '\0' + fi.explanation;
+        return 0;
+      }
+      case (frei0r_image::WORKER_PARAM_INFO): {
+        if ((request.index < 0) || (request.index >= fi.num_params)) {
+          return 1;
+        }
+        const frei0r_image::ParamDescriptor& param = *plugin_.param(request.index);
+        reply.ints[0] = param.type;
+        reply_text = param.name + '\0' + param.explanation;
+        return 0;
+      }
+      case (frei0r_image::WORKER_CONSTRUCT): {
+        return construct(request, text) ? 0 : 1;
+      }
+      case (frei0r_image::WORKER_DESTRUCT): {
+        if (locals_.count(request.id) > 0) {
+          release(locals_[request.id]);
+          locals_.erase(request.id);
+        }
+        return 0;
+      }
+      default:
+        break;
+    }
+
+    if ((locals_.count(request.id) == 0) ||
+        (((request.op == frei0r_image::WORKER_SET_PARAM) ||
+          (request.op == frei0r_image::WORKER_GET_PARAM)) &&
+         ((request.index < 0) || (request.index >= fi.num_params)))) {
+      return 1;
+    }
+    Local& local = locals_[request.id];
+
+    switch (request.op) {
+      case (frei0r_image::WORKER_SET_PARAM): {
+        setParam(local, plugin_.param(request.index)->type, request, text);
+        return 0;
+      }
+      case (frei0r_image::WORKER_GET_PARAM): {
+        getParam(local, plugin_.param(request.index)->type, request.index, reply, reply_text);
+        return 0;
+      }
+      case (frei0r_image::WORKER_UPDATE): {
+        const uint32_t* in[3];
+        for (int i = 0; i < 3; ++i) {
+          in[i] = (request.index & (1 << i)) ?
+              reinterpret_cast<const uint32_t*>(local.frames + i * local.frame_size) : nullptr;
+        }
+        auto out = reinterpret_cast<uint32_t*>(local.frames +
+            frei0r_image::worker_out_frame * local.frame_size);
+        if ((fi.plugin_type == F0R_PLUGIN_TYPE_MIXER2) ||
+            (fi.plugin_type == F0R_PLUGIN_TYPE_MIXER3) || !plugin_.update1) {
+          plugin_.update2(local.instance, request.time, in[0], in[1], in[2], out);
+        } else {
+          plugin_.update1(local.instance, request.time, in[0], out);
+        }
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  void setParam(Local& local, const int type, const frei0r_image::WorkerRequest& request,
+      const std::string& text)
+  {
+    switch (type) {
+      case (F0R_PARAM_BOOL):
+      case (F0R_PARAM_DOUBLE): {
+        double value = request.values[0];
+        plugin_.set_param_value(local.instance, &value, request.index);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        f0r_param_color_t color;
+        color.r = request.values[0];
+        color.g = request.values[1];
+        color.b = request.values[2];
+        plugin_.set_param_value(local.instance, &color, request.index);
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        f0r_param_position_t pos;
+        pos.x = request.values[0];
+        pos.y = request.values[1];
+        plugin_.set_param_value(local.instance, &pos, request.index);
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        std::string copy = text;
+        f0r_param_string value = &copy[0];
+        plugin_.set_param_value(local.instance, &value, request.index);
+        break;
+      }
+    }
+  }
+
+  void getParam(Local& local, const int type, const int index,
+      frei0r_image::WorkerReply& reply, std::string& reply_text)
+  {
+    switch (type) {
+      case (F0R_PARAM_BOOL):
+      case (F0R_PARAM_DOUBLE): {
+        double value = 0.0;
+        plugin_.get_param_value(local.instance, &value, index);
+        reply.values[0] = value;
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        f0r_param_color_t color = {0.0, 0.0, 0.0};
+        plugin_.get_param_value(local.instance, &color, index);
+        reply.values[0] = color.r;
+        reply.values[1] = color.g;
+        reply.values[2] = color.b;
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        f0r_param_position_t pos = {0.0, 0.0};
+        plugin_.get_param_value(local.instance, &pos, index);
+        reply.values[0] = pos.x;
+        reply.values[1] = pos.y;
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        f0r_param_string value = nullptr;
+        plugin_.get_param_value(local.instance, &value, index);
+        reply_text = value ? value : "";
+        break;
+      }
+    }
+  }
+
+  frei0r_image::Plugin plugin_;
+  std::map<int32_t, Local> locals_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    std::cerr << frei0r_image::worker_usage << "\n";
+    return 1;
+  }
+  const int fd = std::atoi(argv[1]);
+
+  // the socket closing ends the loop below when the parent goes away, this
+  // also catches it while a plugin call hangs
+  const pid_t parent = getppid();
+  std::thread([parent]() {
+    while (getppid() == parent) {
+      sleep(1);
+    }
+    _exit(3);
+  }).detach();
+
+  std::unique_ptr<Worker> worker;
+  try {
+    worker = std::make_unique<Worker>(argv[2]);
+  } catch (std::runtime_error& ex) {
+    std::cerr << ex.what() << " '" << argv[2] << "'\n";
+    // the host sees the socket close instead of an info reply
+    return 2;
+  }
+
+  while (true) {
+    frei0r_image::WorkerRequest request;
+    if (!readAll(fd, &request, sizeof(request))) {
+      break;
+    }
+    std::string text(request.text_size, '\0');
+    if (!readAll(fd, &text[0], text.size())) {
+      break;
+    }
+    frei0r_image::WorkerReply reply = {};
+    std::string reply_text;
+    reply.status = worker->handle(request, text, reply, reply_text);
+    reply.text_size = reply_text.size();
+    if (!writeAll(fd, &reply, sizeof(reply)) ||
+        !writeAll(fd, reply_text.data(), reply_text.size())) {
+      break;
+    }
+  }
+  return 0;
+}
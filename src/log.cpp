@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <frei0r_image/log.hpp>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace frei0r_image
+{
+
+namespace
+{
+std::mutex handler_mutex;
+LogHandler handler;
+}  // namespace
+
+void setLogHandler(LogHandler new_handler)
+{
+  std::lock_guard<std::mutex> lock(handler_mutex);
+  handler = std::move(new_handler);
+}
+
+void log(const LogLevel level, const std::string& text)
+{
+  LogHandler current;
+  {
+    std::lock_guard<std::mutex> lock(handler_mutex);
+    current = handler;
+  }
+  if (current) {
+    current(level, text);
+    return;
+  }
+  const char* names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+  std::cerr << "[" << names[static_cast<int>(level)] << "] " << text << "\n";
+}
+
+}  // namespace frei0r_image
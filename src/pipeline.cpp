@@ -0,0 +1,1164 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cv_bridge/cv_bridge.h>
+#include <ddynamic_reconfigure/ddynamic_reconfigure.h>
+#include <experimental/filesystem>
+#include <frei0r.h>
+#include <frei0r_image/conversion_cache.hpp>
+#include <frei0r_image/pipeline.hpp>
+#include <memory>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <string>
+#include <utility>
+
+namespace frei0r_image
+{
+
+Pipeline::Pipeline(ros::NodeHandle nh, ros::NodeHandle private_nh, const std::string& name,
+    ThreadPool* pool) :
+  nh_(nh),
+  private_nh_(private_nh),
+  name_(name),
+  pool_(pool)
+{
+  private_nh_.getParam("priority", priority_);
+  int tile_size = tile_size_;
+  private_nh_.getParam("tile_size", tile_size);
+  tile_size_ = std::max(tile_size, 0);
+  int tile_halo = tile_halo_;
+  private_nh_.getParam("tile_halo", tile_halo);
+  tile_halo_ = std::max(tile_halo, 0);
+  plugin_tile_size_ = tile_size_;
+  bool autotune = false;
+  private_nh_.getParam("autotune", autotune);
+  if (autotune) {
+    const char* home = std::getenv("HOME");
+    std::string cache_path = std::string(home ? home : ".") + "/.ros/frei0r_image_autotune.txt";
+    private_nh_.getParam("autotune_cache", cache_path);
+    private_nh_.getParam("autotune_budget", autotune_budget_);
+    std::vector<int> tile_sizes;
+    if (private_nh_.getParam("autotune_tile_sizes", tile_sizes)) {
+      autotune_tile_sizes_.clear();
+      for (const int size : tile_sizes) {
+        autotune_tile_sizes_.push_back(std::max(size, 0));
+      }
+    }
+    tuning_cache_ = std::make_unique<TuningCache>(cache_path);
+  }
+  pub_ = nh_.advertise<sensor_msgs::Image>("image_out", 3);
+  private_nh_.getParam("compress", compress_);
+  private_nh_.getParam("compress_quality", compress_quality_);
+  if ((compress_ == "jpeg") || (compress_ == "png")) {
+    compressed_pub_ = nh_.advertise<sensor_msgs::CompressedImage>("image_out/compressed", 3);
+  } else if (!compress_.empty()) {
+    ROS_ERROR_STREAM("compress can be jpeg or png, not '" << compress_ << "'");
+    compress_.clear();
+  }
+  int pyramid_levels = 0;
+  private_nh_.getParam("pyramid_levels", pyramid_levels);
+  const std::vector<std::string> level_names = {"half", "quarter", "eighth", "sixteenth"};
+  pyramid_.resize(std::min(std::max(pyramid_levels, 0), static_cast<int>(level_names.size())));
+  for (size_t i = 0; i < pyramid_.size(); ++i) {
+    pyramid_[i].pub = nh_.advertise<sensor_msgs::Image>("image_out_" + level_names[i], 3);
+  }
+  skipped_pub_ = private_nh_.advertise<std_msgs::UInt32>("skipped_updates", 3);
+
+  setupPlugin("none");
+  load_plugin_srv_ = private_nh_.advertiseService("load_plugin",
+      &Pipeline::loadPlugin, this);
+  process_image_srv_ = private_nh_.advertiseService("process_image",
+      &Pipeline::processImage, this);
+  param_batch_sub_ = private_nh_.subscribe("param_batch", 10,
+      &Pipeline::paramBatchCallback, this);
+  private_nh_.getParam("roi_x", pending_roi_.x);
+  private_nh_.getParam("roi_y", pending_roi_.y);
+  private_nh_.getParam("roi_width", pending_roi_.width);
+  private_nh_.getParam("roi_height", pending_roi_.height);
+  roi_sub_ = nh_.subscribe("roi", 3, &Pipeline::roiCallback, this);
+
+  private_nh_.getParam("deadline", deadline_);
+  private_nh_.getParam("shm_out", shm_out_);
+  private_nh_.getParam("shm_slots", shm_slots_);
+  private_nh_.getParam("prefault", prefault_);
+  private_nh_.getParam("render_ahead", render_ahead_);
+  std::string trace_file;
+  if (private_nh_.getParam("trace_file", trace_file) && !trace_file.empty()) {
+    int trace_megabytes = 256;
+    private_nh_.getParam("trace_megabytes", trace_megabytes);
+    try {
+      trace_ = std::make_unique<TraceWriter>(trace_file,
+          static_cast<size_t>(std::max(trace_megabytes, 1)) << 20, prefault_);
+    } catch (std::runtime_error& ex) {
+      ROS_ERROR_STREAM(ex.what() << ", not tracing");
+    }
+  }
+  private_nh_.getParam("isolate", worker_config_.isolate);
+  private_nh_.getParam("worker_path", worker_config_.worker_path);
+  private_nh_.getParam("worker_timeout", worker_config_.timeout);
+  // tiles of an isolated plugin only run in parallel across processes
+  private_nh_.getParam("worker_processes", worker_config_.processes);
+  shm_pub_ = nh_.advertise<ShmFrame>("image_out_shm", 3);
+  // paced plays files back at their frame rate, otherwise every update
+  // takes the next decoded frame
+  bool video_paced = true;
+  private_nh_.getParam("video_paced", video_paced);
+  bool video_loop = true;
+  private_nh_.getParam("video_loop", video_loop);
+  int video_read_ahead = 4;
+  private_nh_.getParam("video_read_ahead", video_read_ahead);
+  double video_fps = 0.0;
+  private_nh_.getParam("video_fps", video_fps);
+  for (size_t i = 0; i < 3; ++i) {
+    const std::string name = "image_in" + std::to_string(i);
+    age_pub_[i] = private_nh_.advertise<std_msgs::Float32>(name + "_age", 3);
+    dropped_pub_[i] = private_nh_.advertise<std_msgs::UInt32>(name + "_dropped", 3);
+    std::string video;
+    if (private_nh_.getParam(name + "_video", video) && !video.empty()) {
+      try {
+        video_readers_[i] = std::make_unique<VideoReader>(video, new_width_, new_height_,
+            std::max(video_read_ahead, 2), video_paced, video_loop, video_fps);
+        continue;
+      } catch (std::runtime_error& ex) {
+        ROS_ERROR_STREAM(ex.what() << ", " << name << " will use its topic");
+      }
+    }
+    // the newest message is all that is wanted, older ones are superseded
+    // in imageCallback where the drop can be counted. A depth of 2 keeps a
+    // frame that arrives while the callback for the previous one is queued
+    // from being dropped by ros where it can't be counted.
+    sub_[i] = nh_.subscribe<sensor_msgs::Image>(name, 2,
+        boost::bind(&Pipeline::imageCallback, this, _1, i));
+    shm_sub_[i] = nh_.subscribe<ShmFrame>(name + "_shm", 2,
+        boost::bind(&Pipeline::shmCallback, this, _1, i));
+  }
+}
+
+Pipeline::~Pipeline()
+{
+  stopRenderAhead();
+  cancelAutotune();
+  {
+    std::lock_guard<std::mutex> lock(service_mutex_);
+    service_instance_ = nullptr;
+  }
+  tiled_ = nullptr;
+  plugin_ = nullptr;
+}
+
+void Pipeline::skipUpdate()
+{
+  ++skipped_;
+  std_msgs::UInt32 msg;
+  msg.data = skipped_;
+  skipped_pub_.publish(msg);
+  ROS_WARN_STREAM_THROTTLE(5.0, name_ << " skipped " << skipped_
+      << " updates, the previous one was still queued or running");
+}
+
+void Pipeline::imageCallback(const sensor_msgs::ImageConstPtr& msg, const size_t index)
+{
+  // conversion is deferred to the update so messages that get replaced
+  // or are already too old never pay for it
+  std::lock_guard<std::mutex> lock(input_mutex_);
+  if (pending_msgs_[index] || pending_shm_[index]) {
+    ++dropped_[index];
+  }
+  pending_msgs_[index] = msg;
+  pending_shm_[index] = nullptr;
+}
+
+void Pipeline::roiCallback(const sensor_msgs::RegionOfInterestConstPtr& msg)
+{
+  // picked up by the next update, like the images
+  std::lock_guard<std::mutex> lock(input_mutex_);
+  pending_roi_ = cv::Rect(msg->x_offset, msg->y_offset, msg->width, msg->height);
+}
+
+cv::Rect Pipeline::activeRoi(cv::Rect& keep) const
+{
+  const cv::Rect frame(0, 0, new_width_, new_height_);
+  keep = roi_ & frame;
+  if (keep.empty() || (keep == frame)) {
+    return cv::Rect();
+  }
+  cv::Rect roi = keep;
+  // Grow to coarse steps so a roi that jitters by a few pixels keeps the
+  // same instance, shifting it back inside the frame where that runs over
+  const int step = 64;
+  roi.width = (roi.width + step - 1) / step * step;
+  roi.height = (roi.height + step - 1) / step * step;
+  roi.x = std::max(std::min(roi.x, frame.width - roi.width), 0);
+  roi.y = std::max(std::min(roi.y, frame.height - roi.height), 0);
+  roi = roi & frame;
+  roi.width -= roi.width % 8;
+  roi.height -= roi.height % 8;
+  keep = keep & roi;
+  if ((roi.width < 8) || (roi.height < 8) || keep.empty()) {
+    return cv::Rect();
+  }
+  return roi;
+}
+
+cv::Size Pipeline::outputSize() const
+{
+  if (tiled_) {
+    return cv::Size(tiled_->width_, tiled_->height_);
+  }
+  if (!frame_roi_.empty()) {
+    return cv::Size(new_width_, new_height_);
+  }
+  return cv::Size(plugin_->instance_->width_, plugin_->instance_->height_);
+}
+
+void Pipeline::shmCallback(const ShmFrameConstPtr& msg, const size_t index)
+{
+  std::lock_guard<std::mutex> lock(input_mutex_);
+  if (pending_msgs_[index] || pending_shm_[index]) {
+    ++dropped_[index];
+  }
+  pending_msgs_[index] = nullptr;
+  pending_shm_[index] = msg;
+}
+
+void Pipeline::convertInput(const cv::Mat& image, const size_t index)
+{
+  cv::Mat& image_in = tiled_ ? tiled_->image_in_[index] :
+      (frame_roi_.empty() ? plugin_->instance_->image_in_[index] : roi_frames_[index]);
+  cv::resize(image, image_in, cv::Size(new_width_, new_height_), 0, 0, cv::INTER_LINEAR);
+}
+
+void Pipeline::convertVideo(const ros::Time& now, const size_t index)
+{
+  VideoReader& reader = *video_readers_[index];
+  reader.setSize(new_width_, new_height_);
+  const uint32_t dropped = reader.takeDropped();
+  if (dropped > 0) {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    dropped_[index] += dropped;
+  }
+  cv::Mat frame;
+  if (!reader.next(now.toSec(), frame)) {
+    return;
+  }
+  // already the right size unless the size just changed
+  convertInput(frame, index);
+  trace_frame_.input_stamps[index] = now.toSec();
+  std_msgs::Float32 age_msg;
+  age_msg.data = 0.0;
+  age_pub_[index].publish(age_msg);
+}
+
+void Pipeline::convertInputs(const ros::Time& now)
+{
+  sensor_msgs::ImageConstPtr msgs[3];
+  ShmFrameConstPtr shm_msgs[3];
+  uint32_t dropped[3];
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    for (size_t i = 0; i < 3; ++i) {
+      msgs[i] = pending_msgs_[i];
+      pending_msgs_[i] = nullptr;
+      shm_msgs[i] = pending_shm_[i];
+      pending_shm_[i] = nullptr;
+    }
+  }
+
+  for (size_t i = 0; i < 3; ++i) {
+    if (video_readers_[i]) {
+      convertVideo(now, i);
+      continue;
+    }
+    if (!msgs[i] && !shm_msgs[i]) {
+      continue;
+    }
+    const ros::Time stamp = msgs[i] ? msgs[i]->header.stamp : shm_msgs[i]->header.stamp;
+    // a zero stamp can't be aged so it is always converted
+    const bool stamped = !stamp.isZero();
+    const double age = stamped ? (now - stamp).toSec() : 0.0;
+    const bool late = stamped && (deadline_ > 0.0) && (age > deadline_);
+    bool converted = false;
+    if (!late && msgs[i]) {
+      try {
+        // other pipelines and nodelets here converting the same message
+        // to the same size share the work
+        auto frame = ConversionCache::instance().get(msgs[i], "bgra8",
+            cv::Size(new_width_, new_height_));
+        convertInput(*frame, i);
+        converted = true;
+      } catch (cv_bridge::Exception& ex) {
+        ROS_ERROR_THROTTLE(1.0, "cv bridge exception %s", ex.what());
+      }
+    } else if (!late) {
+      cv::Mat view;
+      if (shm_readers_[i].view(*shm_msgs[i], view)) {
+        convertInput(view, i);
+        // the writer may have lapped the ring while resizing
+        converted = shm_readers_[i].valid(*shm_msgs[i]);
+      }
+    }
+
+    if (!converted) {
+      std::lock_guard<std::mutex> lock(input_mutex_);
+      ++dropped_[i];
+      continue;
+    }
+
+    trace_frame_.input_stamps[i] = stamp.toSec();
+    std_msgs::Float32 age_msg;
+    age_msg.data = age;
+    age_pub_[i].publish(age_msg);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    std::copy(dropped_, dropped_ + 3, dropped);
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    std_msgs::UInt32 dropped_msg;
+    dropped_msg.data = dropped[i];
+    dropped_pub_[i].publish(dropped_msg);
+  }
+}
+
+void Pipeline::publishShm(const ros::Time& stamp)
+{
+  if (!shm_writer_) {
+    shm_writer_ = std::make_unique<ShmRingWriter>(shmName(name_), shm_slots_);
+  }
+  try {
+    const cv::Size size = outputSize();
+    cv::Mat frame = shm_writer_->beginWrite(size.width, size.height);
+    render(stamp, frame.ptr<uint32_t>());
+    traceStage(TraceFrame::RENDER);
+    ShmFrame desc;
+    shm_writer_->endWrite(stamp, desc);
+    shm_pub_.publish(desc);
+    publishPyramid(stamp, frame);
+
+    if ((pub_.getNumSubscribers() > 0) ||
+        (!compress_.empty() && (compressed_pub_.getNumSubscribers() > 0))) {
+      // a copy, the ring slot gets written again
+      sensor_msgs::ImageConstPtr msg = cv_bridge::CvImage(desc.header, "bgra8", frame).toImageMsg();
+      if (pub_.getNumSubscribers() > 0) {
+        pub_.publish(msg);
+      }
+      publishCompressed(msg);
+    }
+    writeTrace(frame);
+  } catch (std::runtime_error& ex) {
+    ROS_ERROR_STREAM(ex.what() << ", falling back to image_out only");
+    shm_writer_ = nullptr;
+    shm_out_ = false;
+  }
+}
+
+void Pipeline::publishCompressed(const sensor_msgs::ImageConstPtr& msg)
+{
+  if (compress_.empty() || (compressed_pub_.getNumSubscribers() == 0)) {
+    return;
+  }
+  const size_t max_encoding = pool_ ? pool_->size() : 1;
+  if (encoding_.fetch_add(1) >= max_encoding) {
+    encoding_.fetch_sub(1);
+    ROS_WARN_STREAM_THROTTLE(5.0, name_ << " dropping compressed frames, encoding is behind");
+    return;
+  }
+
+  // the message is published so nothing changes it underneath the encode
+  auto encode = [this, msg]() {
+    sensor_msgs::CompressedImagePtr compressed(new sensor_msgs::CompressedImage);
+    compressed->header = msg->header;
+    compressed->format = compressedFormat(compress_);
+    const cv::Mat frame(msg->height, msg->width, CV_8UC4,
+        const_cast<uint8_t*>(&msg->data[0]), msg->step);
+    if (compressFrame(frame, compress_, compress_quality_, compressed->data)) {
+      compressed_pub_.publish(compressed);
+    }
+    encoding_.fetch_sub(1);
+  };
+  // below the updates so encoding never delays a frame
+  if (!pool_ || !pool_->submit(encode, priority_ - 1)) {
+    encode();
+  }
+}
+
+void Pipeline::publishPyramid(const ros::Time& stamp, const cv::Mat& frame)
+{
+  int deepest = -1;
+  for (size_t i = 0; i < pyramid_.size(); ++i) {
+    if (pyramid_[i].pub.getNumSubscribers() > 0) {
+      deepest = i;
+    }
+  }
+
+  cv::Mat src = frame;
+  for (int i = 0; i <= deepest; ++i) {
+    const unsigned int width = src.cols / 2;
+    const unsigned int height = src.rows / 2;
+    if ((width == 0) || (height == 0)) {
+      return;
+    }
+    PyramidLevel& level = pyramid_[i];
+    sensor_msgs::ImagePtr msg;
+    for (auto& pooled : level.pool) {
+      // subscribers in this process may still be looking at the rest
+      if (pooled.use_count() == 1) {
+        msg = pooled;
+        break;
+      }
+    }
+    if (!msg) {
+      msg.reset(new sensor_msgs::Image);
+      msg->encoding = "bgra8";
+      if (level.pool.size() < 4) {
+        level.pool.push_back(msg);
+      }
+    }
+    msg->header.stamp = stamp;
+    msg->width = width;
+    msg->height = height;
+    msg->step = width * 4;
+    msg->data.resize(msg->step * height);
+
+    cv::Mat dst(height, width, CV_8UC4, &msg->data[0], msg->step);
+    downsample2x(src, dst);
+    if (level.pub.getNumSubscribers() > 0) {
+      level.pub.publish(msg);
+    }
+    src = dst;
+  }
+}
+
+void Pipeline::renderRoi(const ros::Time& stamp, uint32_t* out_frame)
+{
+  Instance& instance = *plugin_->instance_;
+  cv::Mat out(new_height_, new_width_, CV_8UC4, out_frame);
+  if (roi_frames_[0].size() == out.size()) {
+    roi_frames_[0].copyTo(out);
+  } else {
+    // sources and filters that haven't had input yet
+    out.setTo(cv::Scalar::all(0));
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    if (roi_frames_[i].size() == out.size()) {
+      roi_frames_[i](frame_roi_).copyTo(instance.image_in_[i]);
+    }
+  }
+
+  if ((keep_roi_ == frame_roi_) && (frame_roi_.width == out.cols)) {
+    // full rows are contiguous in the output, so the plugin can write there
+    instance.update(stamp.toSec(), out.ptr<uint32_t>(frame_roi_.y));
+    return;
+  }
+  roi_out_.resize(frame_roi_.area());
+  instance.update(stamp.toSec(), roi_out_.data());
+  // the instance covers the rounded up roi, only the requested part of it
+  // replaces input 0
+  cv::Mat roi_out(frame_roi_.height, frame_roi_.width, CV_8UC4, roi_out_.data());
+  const cv::Rect keep(keep_roi_.x - frame_roi_.x, keep_roi_.y - frame_roi_.y,
+      keep_roi_.width, keep_roi_.height);
+  cv::Mat dst = out(keep_roi_);
+  roi_out(keep).copyTo(dst);
+}
+
+void Pipeline::stopRenderAhead()
+{
+  if (ahead_) {
+    ahead_->stop();
+    ahead_ = nullptr;
+  }
+}
+
+void Pipeline::render(const ros::Time& stamp, uint32_t* out_frame)
+{
+  if (!frame_roi_.empty()) {
+    renderRoi(stamp, out_frame);
+    return;
+  }
+  if (ahead_) {
+    ahead_->update(stamp.toSec(), tick_period_, out_frame);
+    return;
+  }
+  if (tiled_) {
+    tiled_->update(stamp.toSec(), out_frame);
+    return;
+  }
+  plugin_->instance_->update(stamp.toSec(), out_frame);
+}
+
+bool Pipeline::loadPlugin(LoadPlugin::Request& req, LoadPlugin::Response& resp)
+{
+  resp.success = setupPlugin(req.plugin_path);
+  if (resp.success) {
+  }
+  return true;
+}
+
+bool Pipeline::processImage(ProcessImage::Request& req, ProcessImage::Response& resp)
+{
+  std::lock_guard<std::mutex> service_lock(service_mutex_);
+  resp.success = false;
+  const double time = (req.time > 0.0) ? req.time : ros::Time::now().toSec();
+  size_t num_inputs = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((!plugin_) || (!plugin_->instance_)) {
+      resp.message = "no plugin loaded";
+      return true;
+    }
+    num_inputs = plugin_->numInputs();
+    if (req.images.size() < num_inputs) {
+      resp.message = "the plugin needs " + std::to_string(num_inputs) + " images";
+      return true;
+    }
+
+    unsigned int width = req.width;
+    unsigned int height = req.height;
+    if ((width == 0) || (height == 0)) {
+      width = req.images.empty() ? new_width_ : req.images[0].width;
+      height = req.images.empty() ? new_height_ : req.images[0].height;
+    }
+    adjustWidthHeight(width, height);
+    if ((!service_instance_) || (service_instance_->width_ != width) ||
+        (service_instance_->height_ != height)) {
+      service_instance_ = plugin_->newInstance(width, height);
+      if (!service_instance_->instance_) {
+        service_instance_ = nullptr;
+        resp.message = "no instance for " + std::to_string(width) + " x " + std::to_string(height);
+        return true;
+      }
+    }
+
+    // where the stream is now, then the overrides on top
+    ParamValues values;
+    values.read(*plugin_->instance_);
+    values.write(*service_instance_);
+    for (const auto& value : req.values) {
+      if (!queueParamValue(*service_instance_, value)) {
+        // don't leave the rest queued for the next request
+        service_instance_ = nullptr;
+        resp.message = "bad value for param " + std::to_string(value.index);
+        return true;
+      }
+    }
+  }
+
+  Instance& instance = *service_instance_;
+  const cv::Size size(instance.width_, instance.height_);
+  for (size_t i = 0; i < num_inputs; ++i) {
+    try {
+      auto cv_image = cv_bridge::toCvCopy(req.images[i], "bgra8");
+      // stills are more often scaled down than not, so area over nearest
+      cv::resize(cv_image->image, instance.image_in_[i], size, 0.0, 0.0, cv::INTER_AREA);
+    } catch (cv_bridge::Exception& ex) {
+      resp.message = "image " + std::to_string(i) + ": " + ex.what();
+      return true;
+    }
+  }
+  instance.updateParams(time);
+
+  if (!req.images.empty()) {
+    resp.image.header = req.images[0].header;
+  } else {
+    resp.image.header.stamp = ros::Time::now();
+  }
+  resp.image.encoding = "bgra8";
+  resp.image.width = size.width;
+  resp.image.height = size.height;
+  resp.image.step = size.width * 4;
+  resp.image.data.resize(resp.image.step * size.height);
+  instance.update(time, reinterpret_cast<uint32_t*>(&resp.image.data[0]));
+  resp.success = true;
+  return true;
+}
+
+bool Pipeline::setupPlugin(const std::string& plugin_name)
+{
+  std::lock_guard<std::mutex> service_lock(service_mutex_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  service_instance_ = nullptr;
+  tiled_ = nullptr;
+  stopRenderAhead();
+  cancelAutotune();
+  if (plugin_name == "none") {
+    if (plugin_) {
+      plugin_ = nullptr;
+      ddr_ = nullptr;
+    }
+    if (!ddr_) {
+      // make an empty ddr just to keep client happy (though it won't like
+      // the interruption in service, if it notices).
+      ddr_ = std::make_unique<ddynamic_reconfigure::DDynamicReconfigure>(private_nh_);
+      ddr_->publishServicesTopics();
+    }
+    return true;
+  }
+
+  std::unique_ptr<Plugin> plugin;
+  try {
+    plugin = std::make_unique<Plugin>(plugin_name, worker_config_);
+  } catch (std::runtime_error& ex) {
+    ROS_ERROR_STREAM(ex.what() << " '" << plugin_name << "'");
+    return false;
+  }
+  ROS_INFO_STREAM(plugin_name);
+  if (!plugin) {
+    ROS_ERROR_STREAM("no plugin: '" << plugin_name << "'");
+    return false;
+  }
+
+  plugin->makeInstance(new_width_, new_height_);
+  if (!plugin->instance_) {
+    ROS_ERROR_STREAM("no instance for '" << plugin_name << "'");
+    return false;
+  }
+  if (prefault_) {
+    plugin->instance_->prefaultFrames();
+  }
+
+  plugin_ = std::move(plugin);
+  plugin_tile_size_ = tile_size_;
+  tuned_size_ = cv::Size();
+  plugin_halo_ = tile_halo_;
+  int halo = plugin_halo_;
+  // builtin:addition or 3-point.so aren't valid ros names as they are
+  std::string stem = std::experimental::filesystem::path(plugin_name).stem().string();
+  std::replace_if(stem.begin(), stem.end(),
+      [](const char c) { return !std::isalnum(c) && (c != '_'); }, '_');
+  // only plugins known to tile without seams are listed here, a source
+  // would render its whole image into every tile
+  plugin_tileable_ = private_nh_.getParam("tile_halos/" + stem, halo) &&
+      (plugin_->fi_.plugin_type != F0R_PLUGIN_TYPE_SOURCE);
+  if (plugin_tileable_ && (halo >= 0)) {
+    plugin_halo_ = halo;
+  }
+
+  ddr_ = std::make_unique<ddynamic_reconfigure::DDynamicReconfigure>(private_nh_);
+  // These callbacks don't fire automatically on init, so have to read the params
+  int width = 320;
+  private_nh_.getParam("width", width);
+  new_width_ = width;
+  ddr_->registerVariable<int>("width", 320,
+      boost::bind(&Pipeline::widthCallback, this, _1), "width", 8, 8192);
+  int height = 240;
+  private_nh_.getParam("height", height);
+  new_height_ = height;
+  ddr_->registerVariable<int>("height", 240,
+      boost::bind(&Pipeline::heightCallback, this, _1), "height", 8, 8192);
+  private_nh_.getParam("deadline", deadline_);
+  ddr_->registerVariable<double>("deadline", deadline_,
+      boost::bind(&Pipeline::deadlineCallback, this, _1),
+      "drop input frames older than this many seconds, 0.0 to never drop", 0.0, 5.0);
+
+  param_subs_.clear();
+
+  const ParamDescriptors& params = *plugin_->params_;
+  for (int i = 0; i < static_cast<int>(params.size()); ++i) {
+    const ParamDescriptor& info = params[i];
+    const std::string& param_name = info.ros_name;
+    switch (info.type) {
+      case (F0R_PARAM_BOOL): {
+        ROS_INFO_STREAM(i << " bool '" << param_name << "'");
+        ddr_->registerVariable<bool>(param_name, true,
+            boost::bind(&Pipeline::boolCallback, this, _1, i),
+        // ddr_->registerVariable<double>(param_name, true,
+        //     boost::bind(&Pipeline::doubleCallback, this, _1, i),
+            info.explanation);
+        break;
+      }
+      case (F0R_PARAM_DOUBLE): {
+        // starting with numbers isn't allowed, so prefix everything
+        ROS_INFO_STREAM(i << " double '" << param_name << "'");
+        ddr_->registerVariable<double>(param_name, 0.5,
+            boost::bind(&Pipeline::doubleCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+        param_subs_[param_name] = private_nh_.subscribe<std_msgs::Float32>(
+            param_name, 3,
+            boost::bind(&Pipeline::doubleMsgCallback, this, _1, i));
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        ROS_INFO_STREAM(i << " color '" << param_name << "'");
+        ddr_->registerVariable<double>(param_name + "_r", 0.5,
+            boost::bind(&Pipeline::colorRCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+
+        ddr_->registerVariable<double>(param_name + "_g", 0.5,
+            boost::bind(&Pipeline::colorGCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+
+        ddr_->registerVariable<double>(param_name + "_b", 0.5,
+            boost::bind(&Pipeline::colorBCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        ROS_INFO_STREAM(i << " position '" << param_name << "'");
+        ddr_->registerVariable<double>(param_name + "_x", 0.5,
+            boost::bind(&Pipeline::positionXCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+        ddr_->registerVariable<double>(param_name + "_y", 0.5,
+            boost::bind(&Pipeline::positionYCallback, this, _1, i),
+            info.explanation, 0.0, 1.0);
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        ROS_INFO_STREAM(i << " string '" << param_name << "'");
+        ddr_->registerVariable<std::string>(param_name, "",
+            boost::bind(&Pipeline::stringCallback, this, _1, i),
+            info.explanation);
+        break;
+      }
+    }
+  }
+
+  ddr_->publishServicesTopics();
+  return true;
+}
+
+void Pipeline::widthCallback(int width)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  new_width_ = width;
+}
+
+void Pipeline::heightCallback(int height)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  new_height_ = height;
+}
+
+void Pipeline::deadlineCallback(double deadline)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  deadline_ = deadline;
+}
+
+void Pipeline::boolCallback(bool value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_bools_[param_ind] = value;
+}
+
+void Pipeline::doubleCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_doubles_[param_ind] = value;
+}
+
+void Pipeline::doubleMsgCallback(std_msgs::Float32::ConstPtr msg, int param_ind)
+{
+  doubleCallback(msg->data, param_ind);
+}
+
+void Pipeline::colorRCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_color_r_[param_ind] = value;
+}
+
+void Pipeline::colorGCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_color_g_[param_ind] = value;
+}
+
+void Pipeline::colorBCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_color_b_[param_ind] = value;
+}
+
+void Pipeline::positionXCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_position_x_[param_ind] = value;
+}
+
+void Pipeline::positionYCallback(double value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_position_y_[param_ind] = value;
+}
+
+void Pipeline::stringCallback(const std::string value, int param_ind)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  plugin_->instance_->update_string_[param_ind] = value;
+}
+
+bool Pipeline::queueParamValue(Instance& instance, const ParamValue& value)
+{
+  const ParamDescriptor* param = plugin_->param(value.index);
+  if (!param || (param->type != value.type) || (value.values.size() < param->num_values)) {
+    return false;
+  }
+  const int ind = value.index;
+  switch (param->type) {
+    case (F0R_PARAM_BOOL): {
+      instance.update_bools_[ind] = value.values[0] > 0.5;
+      break;
+    }
+    case (F0R_PARAM_DOUBLE): {
+      instance.update_doubles_[ind] = value.values[0];
+      break;
+    }
+    case (F0R_PARAM_COLOR): {
+      instance.update_color_r_[ind] = value.values[0];
+      instance.update_color_g_[ind] = value.values[1];
+      instance.update_color_b_[ind] = value.values[2];
+      break;
+    }
+    case (F0R_PARAM_POSITION): {
+      instance.update_position_x_[ind] = value.values[0];
+      instance.update_position_y_[ind] = value.values[1];
+      break;
+    }
+    case (F0R_PARAM_STRING): {
+      instance.update_string_[ind] = value.text;
+      break;
+    }
+  }
+  return true;
+}
+
+void Pipeline::paramBatchCallback(const ParamBatchConstPtr& msg)
+{
+  // update holds this for the whole frame, so the batch can't be split
+  std::lock_guard<std::mutex> lock(mutex_);
+  if ((!plugin_) || (!plugin_->instance_)) {
+    return;
+  }
+  Instance& instance = *plugin_->instance_;
+  for (const auto& value : msg->values) {
+    if (!queueParamValue(instance, value)) {
+      ROS_WARN_STREAM_THROTTLE(1.0, "bad value for param " << value.index
+          << " type " << static_cast<int>(value.type));
+    }
+  }
+
+  for (const auto& automation : msg->automations) {
+    const ParamDescriptor* param = plugin_->param(automation.index);
+    if (!param || (automation.component >= param->num_values)) {
+      ROS_WARN_STREAM_THROTTLE(1.0, "can't automate param " << automation.index
+          << " component " << static_cast<int>(automation.component));
+      continue;
+    }
+    const auto key = std::make_pair(automation.index, static_cast<int>(automation.component));
+    if (automation.mode == ParamAutomation::NONE) {
+      instance.curves_.erase(key);
+      continue;
+    }
+
+    ParamCurve curve;
+    curve.type = param->type;
+    curve.start = automation.start.isZero() ? ros::Time::now().toSec() : automation.start.toSec();
+    if (automation.mode == ParamAutomation::KEYFRAMES) {
+      if (automation.times.empty() || (automation.times.size() != automation.values.size()) ||
+          !std::is_sorted(automation.times.begin(), automation.times.end())) {
+        ROS_WARN_STREAM_THROTTLE(1.0, "param " << automation.index
+            << " keyframes need sorted times, one per value");
+        continue;
+      }
+      curve.mode = ParamCurve::KEYFRAMES;
+      curve.times = automation.times;
+      curve.values = automation.values;
+      curve.loop = automation.loop;
+    } else {
+      curve.mode = ParamCurve::LFO;
+      curve.waveform = static_cast<ParamCurve::Waveform>(
+          std::min(automation.waveform, static_cast<uint8_t>(ParamCurve::SAW)));
+      curve.frequency = automation.frequency;
+      curve.phase = automation.phase;
+      curve.offset = automation.offset;
+      curve.amplitude = automation.amplitude;
+    }
+    instance.curves_[key] = curve;
+  }
+}
+
+void Pipeline::autotuneTileSize()
+{
+  TuneResult result;
+  if (autotune_job_) {
+    bool ok = false;
+    cv::Size size;
+    {
+      std::lock_guard<std::mutex> lock(autotune_job_->mutex);
+      if (!autotune_job_->done) {
+        return;
+      }
+      ok = autotune_job_->ok;
+      result = autotune_job_->result;
+      size = autotune_job_->size;
+    }
+    autotune_job_ = nullptr;
+    if (!ok) {
+      // nothing is cached, the next update measures again
+      tuned_size_ = cv::Size();
+      return;
+    }
+    tuning_cache_->store(TuningCache::key(*plugin_, size.width, size.height), result);
+    if (size != cv::Size(new_width_, new_height_)) {
+      // measured for a size that is already gone, try again with this one
+      return;
+    }
+  } else {
+    tuned_size_ = cv::Size(new_width_, new_height_);
+    if (!tuning_cache_->find(TuningCache::key(*plugin_, new_width_, new_height_), result)) {
+      startAutotune();
+      return;
+    }
+  }
+  plugin_tile_size_ = result.tile_size;
+  ROS_INFO_STREAM(name_ << " " << plugin_->plugin_name_ << " " << new_width_ << " x "
+      << new_height_ << (result.tile_size ? " in tiles of " + std::to_string(result.tile_size) :
+      std::string(" as a single instance")));
+}
+
+void Pipeline::startAutotune()
+{
+  ROS_INFO_STREAM(name_ << " autotuning " << plugin_->plugin_name_ << " at "
+      << new_width_ << " x " << new_height_);
+  ParamValues values;
+  values.read(*plugin_->instance_);
+  auto job = std::make_shared<AutotuneJob>();
+  job->size = tuned_size_;
+  // runs without mutex_ so frames keep coming with the current tile size
+  // meanwhile, below them on the pool. Nothing in it refers to this
+  // pipeline, a cancelled job can run after it is gone.
+  auto task = [job, plugin = plugin_.get(), values, tile_sizes = autotune_tile_sizes_,
+      halo = plugin_halo_, pool = pool_, budget = autotune_budget_]() {
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (job->cancelled) {
+        return;
+      }
+      job->running = true;
+    }
+    TuneResult result;
+    bool ok = false;
+    try {
+      result = autotune(*plugin, values, job->size.width, job->size.height, tile_sizes, halo,
+          pool, budget);
+      ok = true;
+    } catch (std::exception& ex) {
+      ROS_WARN_STREAM("autotuning " << plugin->plugin_name_ << " failed: " << ex.what());
+    }
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->result = result;
+      job->ok = ok;
+      job->running = false;
+      job->done = true;
+    }
+    job->cond.notify_all();
+  };
+  if (!pool_->submit(task, priority_ - 1)) {
+    // pool is full, try again next update
+    tuned_size_ = cv::Size();
+    return;
+  }
+  autotune_job_ = job;
+}
+
+void Pipeline::cancelAutotune()
+{
+  if (!autotune_job_) {
+    return;
+  }
+  {
+    // A queued job never starts, a running one only needs the pool and
+    // plugin_ so it finishes even with mutex_ held
+    std::unique_lock<std::mutex> lock(autotune_job_->mutex);
+    autotune_job_->cancelled = true;
+    auto& job = *autotune_job_;
+    job.cond.wait(lock, [&job] { return !job.running; });
+  }
+  autotune_job_ = nullptr;
+}
+
+void Pipeline::traceStage(const TraceFrame::Stage stage)
+{
+  if (!trace_) {
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  trace_frame_.timings[stage] = std::chrono::duration<float>(now - trace_mark_).count();
+  trace_mark_ = now;
+}
+
+void Pipeline::writeTrace(const cv::Mat& frame)
+{
+  if (!trace_) {
+    return;
+  }
+  traceStage(TraceFrame::PUBLISH);
+  trace_frame_.params = nullptr;
+  // isolated plugins would need a round trip to the worker per parameter
+  if (!plugin_->instance_->remote_) {
+    trace_params_.read(*plugin_->instance_);
+    trace_frame_.params = &trace_params_;
+  }
+  try {
+    trace_->write(trace_frame_, plugin_->plugin_name_, frame);
+  } catch (std::runtime_error& ex) {
+    ROS_ERROR_STREAM(ex.what() << ", no more tracing");
+    trace_ = nullptr;
+  }
+}
+
+void Pipeline::update(const ros::Time& stamp)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (trace_) {
+    trace_frame_ = TraceFrame();
+    trace_frame_.stamp = stamp.toSec();
+    trace_mark_ = std::chrono::steady_clock::now();
+  }
+  adjustWidthHeight(new_width_, new_height_);
+  if (!plugin_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> input_lock(input_mutex_);
+    roi_ = pending_roi_;
+  }
+  frame_roi_ = activeRoi(keep_roi_);
+  if (frame_roi_.empty()) {
+    for (auto& frame : roi_frames_) {
+      frame.release();
+    }
+  }
+  // a single instance is all there is to try without tiling
+  if (tuning_cache_ && plugin_tileable_ && pool_ && frame_roi_.empty() &&
+      ((tuned_size_ != cv::Size(new_width_, new_height_)) || autotune_job_)) {
+    autotuneTileSize();
+  }
+  const bool tiled = plugin_tileable_ && frame_roi_.empty() && (plugin_tile_size_ > 0) &&
+      ((new_width_ > plugin_tile_size_) || (new_height_ > plugin_tile_size_));
+  if (!last_stamp_.isZero() && (stamp > last_stamp_)) {
+    tick_period_ = 0.9 * tick_period_ + 0.1 * (stamp - last_stamp_).toSec();
+  }
+  last_stamp_ = stamp;
+
+  if (tiled) {
+    stopRenderAhead();
+    if (!plugin_->instance_) {
+      plugin_->makeInstance(plugin_tile_size_, plugin_tile_size_);
+    }
+    // autotuning can change the tile size at any point
+    if ((!tiled_) || (new_width_ != tiled_->width_) || (new_height_ != tiled_->height_) ||
+        (plugin_tile_size_ != tiled_->tile_size_)) {
+      try {
+        tiled_ = std::make_unique<TiledInstance>(*plugin_, new_width_, new_height_,
+            plugin_tile_size_, plugin_halo_, pool_);
+        ROS_INFO_STREAM(name_ << " tiling " << plugin_->plugin_name_ << " at " << new_width_
+            << " x " << new_height_);
+      } catch (std::runtime_error& ex) {
+        ROS_ERROR_STREAM_THROTTLE(1.0, ex.what());
+        tiled_ = nullptr;
+        return;
+      }
+    }
+  } else {
+    tiled_ = nullptr;
+    const unsigned int width = frame_roi_.empty() ? new_width_ : frame_roi_.width;
+    const unsigned int height = frame_roi_.empty() ? new_height_ : frame_roi_.height;
+    if ((!plugin_->instance_) ||
+        (width != plugin_->instance_->width_) ||
+        (height != plugin_->instance_->height_)) {
+      auto previous = std::move(plugin_->instance_);
+      plugin_->makeInstance(width, height);
+      if (previous && previous->instance_ && plugin_->instance_->instance_) {
+        plugin_->instance_->copyState(*previous);
+      }
+      if (prefault_ && plugin_->instance_) {
+        plugin_->instance_->prefaultFrames();
+      }
+    }
+
+    const bool ahead = (render_ahead_ > 0) && frame_roi_.empty() &&
+        (plugin_->fi_.plugin_type == F0R_PLUGIN_TYPE_SOURCE);
+    if (!ahead || (ahead_ && ((ahead_->width_ != width) || (ahead_->height_ != height)))) {
+      stopRenderAhead();
+    }
+    if (ahead && !ahead_) {
+      try {
+        ahead_ = std::make_shared<RenderAhead>(*plugin_, width, height, render_ahead_, pool_);
+      } catch (std::runtime_error& ex) {
+        ROS_ERROR_STREAM_THROTTLE(1.0, ex.what());
+      }
+    }
+  }
+
+  convertInputs(ros::Time::now());
+  traceStage(TraceFrame::CONVERT);
+
+  // TODO(lucasw) need to call updateConfig to update dynamic reconfigure
+  // clients with new values that have arrived via topics.
+
+  plugin_->instance_->updateParams(stamp.toSec());
+  if (tiled_) {
+    tiled_->copyParams(*plugin_->instance_);
+  }
+  if (ahead_) {
+    ahead_->copyParams(*plugin_->instance_);
+  }
+  traceStage(TraceFrame::PARAMS);
+  if (shm_out_) {
+    publishShm(stamp);
+    return;
+  }
+
+  const cv::Size size = outputSize();
+  const unsigned int width = size.width;
+  const unsigned int height = size.height;
+  sensor_msgs::ImagePtr msg(new sensor_msgs::Image);
+  msg->header.stamp = stamp;
+  msg->encoding = "bgra8";
+  msg->width = width;
+  msg->height = height;
+  msg->step = width * 4;
+  msg->data.resize(msg->step * height);
+  render(stamp, reinterpret_cast<uint32_t*>(&msg->data[0]));
+  traceStage(TraceFrame::RENDER);
+  pub_.publish(msg);
+  publishCompressed(msg);
+  // only reads the published frame
+  const cv::Mat frame(height, width, CV_8UC4, &msg->data[0], msg->step);
+  publishPyramid(stamp, frame);
+  writeTrace(frame);
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,651 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ * Load frei0r plugins following these guidelines:
+ * https://frei0r.dyne.org/codedoc/html/group__pluglocations.html
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <dlfcn.h>
+#include <frei0r.h>
+#include <frei0r_image/builtin.hpp>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/plugin.hpp>
+#include <frei0r_image/realtime.hpp>
+#include <memory>
+#include <opencv2/imgproc.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace frei0r_image
+{
+
+std::string sanitize(const std::string& text)
+{
+  std::string text2 = text;
+  // spaces aren't allowed
+  for (char& c : text2) {
+    if (!std::isalnum(c)) {
+      c = '_';
+    }
+  }
+
+  text2 = "p" + text2;
+  return text2;
+}
+
+// TODO(lucasw) pass in string to store error messages
+Plugin::Plugin(const std::string& name, const WorkerConfig& config)
+{
+  if (name == "none") {
+    return;
+  }
+  FREI0R_INFO_STREAM("loading " << name);
+  plugin_name_ = name;
+  if (config.isolate) {
+    // throws if the worker can't load it
+    remote_ = std::make_shared<RemoteWorker>(name, config);
+    fi_ = remote_->info();
+    loadParams();
+    print();
+    return;
+  }
+  if (isBuiltin(name)) {
+    // compiled in, there is nothing to dlopen or dlclose
+    if (!loadBuiltin(name, *this)) {
+      throw std::runtime_error("no such builtin");
+    }
+    init();
+    get_plugin_info(&fi_);
+    loadParams();
+    print();
+    return;
+  }
+  handle_ = dlopen(name.c_str(), RTLD_NOW);
+  if (!handle_) {
+    throw std::runtime_error("no plugin");
+  }
+  // std::cout << name << " " << handle_ << "\n";
+
+  init = (f0r_init_t)dlsym(handle_, "f0r_init");
+  deinit = (f0r_deinit_t)dlsym(handle_, "f0r_deinit");
+  get_plugin_info = (f0r_get_plugin_info_t)dlsym(handle_, "f0r_get_plugin_info");
+  get_param_info = (f0r_get_param_info_t)dlsym(handle_, "f0r_get_param_info");
+  construct = (f0r_construct_t)dlsym(handle_, "f0r_construct");
+  destruct = (f0r_destruct_t)dlsym(handle_, "f0r_destruct");
+  set_param_value = (f0r_set_param_value_t)dlsym(handle_, "f0r_set_param_value");
+  get_param_value = (f0r_get_param_value_t)dlsym(handle_, "f0r_get_param_value");
+  update1 = (f0r_update_t)dlsym(handle_, "f0r_update");
+  update2 = (f0r_update2_t)dlsym(handle_, "f0r_update2");
+
+  if (init == 0 || deinit == 0 || get_plugin_info == 0 ||
+    get_param_info == 0 || construct == 0 || destruct == 0 ||
+    set_param_value == 0 || get_param_value == 0 ||
+    (update1 == 0 && update2 == 0)) {
+    // throw std::runtime_error("some symbols are missing in frei0r plugin");
+    FREI0R_ERROR_STREAM("some symbols are missing in frei0r plugin");
+    // TODO(lucasw) throw
+    throw std::runtime_error("bad plugin");
+  }
+
+  init();
+
+  FREI0R_INFO_STREAM("get info");
+  get_plugin_info(&fi_);
+  loadParams();
+  print();
+}
+
+Plugin::~Plugin()
+{
+  if (remote_) {
+    instance_ = nullptr;
+    remote_ = nullptr;
+  }
+  if (handle_) {
+    FREI0R_INFO_STREAM("shutting down " << plugin_name_);
+    instance_ = nullptr;
+    deinit();
+    dlclose(handle_);
+  }
+}
+
+void Plugin::print()
+{
+  std::stringstream ss;
+  ss << "'" << plugin_name_ << "' {\n";
+  ss << fi_.name << " by " << fi_.author << "\n";
+  ss << "type: " << fi_.plugin_type << " " << plugin_types[fi_.plugin_type] << "\n";
+  ss << "color model: " << fi_.color_model << " " << color_models[fi_.color_model] << "\n";
+  ss << "frei0r_version: " << fi_.frei0r_version << "\n";
+  ss << "major_version: " << fi_.major_version << "\n";
+  ss << "minor_version: " << fi_.minor_version << "\n";
+  ss << "num_params: " << fi_.num_params << "\n";
+  for (size_t i = 0; i < params_->size(); ++i) {
+    const ParamDescriptor& param = (*params_)[i];
+    ss << "  " << i << " '" << param.name << "' " << param_types[param.type]
+        << " '" << param.explanation << "'\n";
+  }
+  ss << "explanation: " << fi_.explanation << "\n";
+
+  // for (size_t i = 0; i < 8 && i < out_frame_.size(); ++i) {
+  //   ss << std::hex << out_frame_[i] << " ";
+  // }
+  ss << "\n";
+  ss << "}\n";
+  FREI0R_INFO_STREAM(ss.str());
+}
+
+void Plugin::loadParams()
+{
+  const size_t num_values[5] = {1, 1, 3, 2, 0};
+  auto params = std::make_shared<ParamDescriptors>();
+  for (int i = 0; i < fi_.num_params; ++i) {
+    f0r_param_info_t info;
+    if (remote_) {
+      remote_->getParamInfo(&info, i);
+    } else {
+      get_param_info(&info, i);
+    }
+    if ((info.type < F0R_PARAM_BOOL) || (info.type > F0R_PARAM_STRING)) {
+      throw std::runtime_error("param " + std::to_string(i) + " has unknown type "
+          + std::to_string(info.type));
+    }
+    ParamDescriptor param;
+    param.name = info.name ? info.name : "";
+    param.ros_name = sanitize(param.name);
+    param.type = info.type;
+    param.explanation = info.explanation ? info.explanation : "";
+    param.num_values = num_values[info.type];
+    params->push_back(param);
+  }
+  params_ = params;
+}
+
+int Plugin::findParam(const std::string& name) const
+{
+  for (size_t i = 0; i < params_->size(); ++i) {
+    const ParamDescriptor& param = (*params_)[i];
+    if ((name == param.name) || (name == param.ros_name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void adjustWidthHeight(unsigned int& width, unsigned int& height)
+{
+  const unsigned align = 8;
+  width -= width % 8;
+  if (width == 0) {
+    width = align;
+  }
+  height -= height % 8;
+  if (height == 0) {
+    height = align;
+  }
+}
+
+Instance::Instance(unsigned int& width, unsigned int& height,
+  f0r_construct_t construct,
+  f0r_destruct_t destruct,
+  f0r_update_t update1,
+  f0r_update2_t update2,
+  f0r_plugin_info fi,
+  std::shared_ptr<const ParamDescriptors> params,
+  f0r_get_param_value_t get_param_value,
+  f0r_set_param_value_t set_param_value,
+  std::shared_ptr<RemoteWorker> remote) :
+  construct(construct),
+  destruct(destruct),
+  fi_(fi),
+  update1(update1),
+  update2(update2),
+  get_param_value(get_param_value),
+  set_param_value(set_param_value),
+  remote_(remote),
+  params_(params)
+{
+  adjustWidthHeight(width, height);
+  FREI0R_INFO_STREAM("width " << width << " x height " << height);
+
+  {
+    width_ = width;
+    height_ = height;
+    if (remote_) {
+      instance_ = remote_->construct(width_, height_);
+    } else {
+      instance_ = construct(width_, height_);
+    }
+    // getValues();
+    if (fi_.plugin_type == F0R_PLUGIN_TYPE_SOURCE) {
+      return;
+    }
+    if (remote_ && instance_) {
+      // inputs resized into these land directly in the worker's
+      // shared memory and don't need another copy
+      for (int i = 0; i < 3; ++i) {
+        image_in_[i] = cv::Mat(height_, width_, CV_8UC4, remote_->frame(instance_, i));
+      }
+    }
+    const size_t num = width * height;  // * 4;
+    in_frame_.resize(num);
+    // out_frame_.resize(num);
+  }
+}
+
+Instance::~Instance()
+{
+  if (remote_) {
+    remote_->destruct(instance_);
+    return;
+  }
+  destruct(instance_);
+}
+
+void Instance::setParam(f0r_param_t param, const int ind)
+{
+  if (remote_) {
+    remote_->setParamValue(instance_, param, ind);
+    return;
+  }
+  set_param_value(instance_, param, ind);
+}
+
+void Instance::getParam(f0r_param_t param, const int ind)
+{
+  if (remote_) {
+    remote_->getParamValue(instance_, param, ind);
+    return;
+  }
+  get_param_value(instance_, param, ind);
+}
+
+void Instance::process(const double time, const uint32_t* in0, const uint32_t* in1,
+    const uint32_t* in2, uint32_t* out)
+{
+  if (remote_) {
+    remote_->update(instance_, time, in0, in1, in2, out);
+    return;
+  }
+  if ((fi_.plugin_type == F0R_PLUGIN_TYPE_MIXER2) ||
+      (fi_.plugin_type == F0R_PLUGIN_TYPE_MIXER3)) {
+    update2(instance_, time, in0, in1, in2, out);
+  } else {
+    update1(instance_, time, in0, out);
+  }
+}
+
+size_t numInputs(const int plugin_type)
+{
+  switch (plugin_type) {
+    case (F0R_PLUGIN_TYPE_FILTER):
+      return 1;
+    case (F0R_PLUGIN_TYPE_MIXER2):
+      return 2;
+    case (F0R_PLUGIN_TYPE_MIXER3):
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+void Instance::prefaultFrames()
+{
+  for (size_t i = 0; i < numInputs(); ++i) {
+    // inputs get resized into these, so once they are the right size
+    // they are never reallocated
+    image_in_[i].create(height_, width_, CV_8UC4);
+    prefault(image_in_[i].data, image_in_[i].total() * image_in_[i].elemSize());
+  }
+  prefault(in_frame_.data(), in_frame_.size() * sizeof(uint32_t));
+}
+
+void Instance::getValues()
+{
+  if (!instance_) {
+    return;
+  }
+  for (size_t i = 0; i < params_->size(); ++i) {
+    const ParamDescriptor& info = (*params_)[i];
+    switch (info.type) {
+      case (F0R_PARAM_BOOL): {
+        double value;
+        getParam(reinterpret_cast<void*>(&value), i);
+        update_bools_[i] = value > 0.5;
+        FREI0R_INFO_STREAM("bool '" << info.name << "': " << value);
+        break;
+      }
+      case (F0R_PARAM_DOUBLE): {
+        double value;
+        getParam(reinterpret_cast<void*>(&value), i);
+        update_doubles_[i] = value;
+        FREI0R_INFO_STREAM("double '" << info.name << "': " << value);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        f0r_param_position_t pos;
+        getParam(reinterpret_cast<f0r_param_t>(&pos), i);
+        FREI0R_INFO_STREAM("position '" << info.name << "': " << pos.x << " " << pos.y);
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        break;
+      }
+    }  // switch on param type
+  }  // loop through params
+}
+
+bool ParamValues::Value::operator==(const Value& other) const
+{
+  return std::equal(numbers, numbers + 3, other.numbers) && (text == other.text);
+}
+
+void ParamValues::read(Instance& from)
+{
+  const ParamDescriptors& params = *from.params_;
+  values.resize(params.size());
+  for (size_t i = 0; i < params.size(); ++i) {
+    Value& value = values[i];
+    switch (params[i].type) {
+      case (F0R_PARAM_BOOL):
+      case (F0R_PARAM_DOUBLE): {
+        from.getParam(reinterpret_cast<f0r_param_t>(&value.numbers[0]), i);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        f0r_param_color_t color = {0.0, 0.0, 0.0};
+        from.getParam(reinterpret_cast<f0r_param_t>(&color), i);
+        value.numbers[0] = color.r;
+        value.numbers[1] = color.g;
+        value.numbers[2] = color.b;
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        f0r_param_position_t pos = {0.0, 0.0};
+        from.getParam(reinterpret_cast<f0r_param_t>(&pos), i);
+        value.numbers[0] = pos.x;
+        value.numbers[1] = pos.y;
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        f0r_param_string text = nullptr;
+        from.getParam(reinterpret_cast<f0r_param_t>(&text), i);
+        value.text = text ? text : "";
+        break;
+      }
+    }
+  }
+}
+
+void ParamValues::write(Instance& to, const ParamValues* previous) const
+{
+  const ParamDescriptors& params = *to.params_;
+  for (size_t i = 0; (i < values.size()) && (i < params.size()); ++i) {
+    const Value& value = values[i];
+    // each set is a round trip for isolated plugins
+    if (previous && (i < previous->values.size()) && (value == previous->values[i])) {
+      continue;
+    }
+    switch (params[i].type) {
+      case (F0R_PARAM_BOOL):
+      case (F0R_PARAM_DOUBLE): {
+        to.setParamValue(value.numbers[0], i);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        f0r_param_color_t color;
+        color.r = value.numbers[0];
+        color.g = value.numbers[1];
+        color.b = value.numbers[2];
+        to.setParam(reinterpret_cast<f0r_param_t>(&color), i);
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        f0r_param_position_t pos;
+        pos.x = value.numbers[0];
+        pos.y = value.numbers[1];
+        to.setParam(reinterpret_cast<f0r_param_t>(&pos), i);
+        break;
+      }
+      case (F0R_PARAM_STRING): {
+        to.setString(value.text, i);
+        break;
+      }
+    }
+  }
+}
+
+double ParamCurve::evaluate(const double time) const
+{
+  const double t = time - start;
+  if (mode == LFO) {
+    double cycle = frequency * t + phase;
+    cycle -= std::floor(cycle);
+    switch (waveform) {
+      case (SINE):
+        return offset + amplitude * std::sin(2.0 * M_PI * cycle);
+      case (TRIANGLE):
+        return offset + amplitude * (1.0 - 4.0 * std::abs(cycle - 0.5));
+      case (SQUARE):
+        return offset + amplitude * ((cycle < 0.5) ? 1.0 : -1.0);
+      default:
+        return offset + amplitude * (2.0 * cycle - 1.0);
+    }
+  }
+
+  if (times.empty()) {
+    return 0.0;
+  }
+  double key = t;
+  const double span = times.back() - times.front();
+  if (loop && (span > 0.0)) {
+    key = times.front() + std::fmod(t - times.front(), span);
+    if (key < times.front()) {
+      key += span;
+    }
+  }
+  if (key <= times.front()) {
+    return values.front();
+  }
+  if (key >= times.back()) {
+    return values.back();
+  }
+  const size_t ind = std::upper_bound(times.begin(), times.end(), key) - times.begin();
+  const double fr = (key - times[ind - 1]) / (times[ind] - times[ind - 1]);
+  return values[ind - 1] + fr * (values[ind] - values[ind - 1]);
+}
+
+void Instance::copyState(Instance& from)
+{
+  ParamValues values;
+  values.read(from);
+  values.write(*this);
+  update_bools_ = from.update_bools_;
+  update_doubles_ = from.update_doubles_;
+  update_color_r_ = from.update_color_r_;
+  update_color_g_ = from.update_color_g_;
+  update_color_b_ = from.update_color_b_;
+  update_position_x_ = from.update_position_x_;
+  update_position_y_ = from.update_position_y_;
+  update_string_ = from.update_string_;
+  curves_ = from.curves_;
+}
+
+void Instance::updateParams(const double time)
+{
+  for (auto& pair : update_bools_) {
+    setParamValue(pair.second, pair.first);
+  }
+  update_bools_.clear();
+
+  for (auto& pair : update_doubles_) {
+    setParamValue(pair.second, pair.first);
+  }
+  update_doubles_.clear();
+
+  // color
+  for (auto& pair : update_color_r_) {
+    setColorR(pair.second, pair.first);
+  }
+  update_color_r_.clear();
+
+  for (auto& pair : update_color_g_) {
+    setColorG(pair.second, pair.first);
+  }
+  update_color_g_.clear();
+
+  for (auto& pair : update_color_b_) {
+    setColorB(pair.second, pair.first);
+  }
+  update_color_b_.clear();
+
+  // position
+  for (auto& pair : update_position_x_) {
+    setPositionX(pair.second, pair.first);
+  }
+  update_position_x_.clear();
+
+  for (auto& pair : update_position_y_) {
+    setPositionY(pair.second, pair.first);
+  }
+  update_position_y_.clear();
+
+  for (auto& pair : update_string_) {
+    setString(pair.second, pair.first);
+  }
+  update_string_.clear();
+
+  for (auto& pair : curves_) {
+    const int ind = pair.first.first;
+    const int component = pair.first.second;
+    const double value = pair.second.evaluate(time);
+    switch (pair.second.type) {
+      case (F0R_PARAM_BOOL): {
+        setParamValue(value > 0.5, ind);
+        break;
+      }
+      case (F0R_PARAM_DOUBLE): {
+        setParamValue(value, ind);
+        break;
+      }
+      case (F0R_PARAM_COLOR): {
+        if (component == 0) {
+          setColorR(value, ind);
+        } else if (component == 1) {
+          setColorG(value, ind);
+        } else {
+          setColorB(value, ind);
+        }
+        break;
+      }
+      case (F0R_PARAM_POSITION): {
+        if (component == 0) {
+          setPositionX(value, ind);
+        } else {
+          setPositionY(value, ind);
+        }
+        break;
+      }
+    }
+  }
+}
+
+#if 0
+Plugin::update(const double time)
+{
+  if (!instance_) {
+    return;
+  }
+  instance_->update(time)
+}
+#endif
+
+void Instance::update(const double time, uint32_t* image_out_data)
+{
+  const auto width = width_;
+  const auto height = height_;
+  if ((width < 8) || (height < 8)) {
+    return;
+  }
+
+  const auto sz = cv::Size(width, height);
+  const double time_val = time;
+
+  // if ((fi_.plugin_type != F0R_PLUGIN_TYPE_MIXER2) &&
+  //     (fi_.plugin_type != F0R_PLUGIN_TYPE_MIXER3)) {
+  switch (fi_.plugin_type) {
+    case (F0R_PLUGIN_TYPE_FILTER): {
+      if (!image_in_[0].empty() &&
+          (image_in_[0].cols > 0) &&
+          (image_in_[0].rows > 0)) {
+        // TODO(lucasw) image_in_msg width and height may not be
+        // multiples of 8
+        {
+          const int i = 0;
+          cv::resize(image_in_[i], image_in_[i],
+              sz,
+              cv::INTER_NEAREST);
+        }
+        process(time_val,
+            reinterpret_cast<uint32_t*>(&image_in_[0].data[0]),
+            nullptr, nullptr,
+            image_out_data);
+      }
+      break;
+    }
+    case  (F0R_PLUGIN_TYPE_SOURCE): {
+      process(time_val,
+          nullptr, nullptr, nullptr,
+          image_out_data);
+      break;
+    }
+    case (F0R_PLUGIN_TYPE_MIXER2): {
+      if (!image_in_[0].empty() && !image_in_[0].empty()) {
+        for (size_t i = 0; i < 2; ++i) {
+          if (image_in_[i].cols < 1) {
+            return;
+          }
+          if (image_in_[i].rows < 1) {
+            return;
+          }
+          cv::resize(image_in_[i], image_in_[i],
+              sz, cv::INTER_NEAREST);
+        }
+        // FREI0R_INFO_STREAM(image_in_[0].size() << " " << image_in_[1].size());
+        process(time_val,
+            reinterpret_cast<uint32_t*>(&image_in_[0].data[0]),
+            reinterpret_cast<uint32_t*>(&image_in_[1].data[0]),
+            nullptr,
+            image_out_data);
+      }
+      break;
+    }
+    case (F0R_PLUGIN_TYPE_MIXER3): {
+      if (!image_in_[0].empty() && !image_in_[0].empty()) {
+        for (size_t i = 0; i < 3; ++i) {
+          if (image_in_[i].cols < 1) {
+            return;
+          }
+          if (image_in_[i].rows < 1) {
+            return;
+          }
+          cv::resize(image_in_[i], image_in_[i],
+              sz, cv::INTER_NEAREST);
+        }
+        process(time_val,
+            reinterpret_cast<uint32_t*>(&image_in_[0].data[0]),
+            reinterpret_cast<uint32_t*>(&image_in_[1].data[0]),
+            reinterpret_cast<uint32_t*>(&image_in_[2].data[0]),
+            image_out_data);
+      }
+      break;
+    }
+  }
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/realtime.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace frei0r_image
+{
+
+bool tuneCurrentThread(const ThreadTuning& tuning)
+{
+  bool ok = true;
+  if (!tuning.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : tuning.cpus) {
+      if ((cpu >= 0) && (cpu < CPU_SETSIZE)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    const int rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rv != 0) {
+      FREI0R_WARN_STREAM("can't set cpu affinity: " << std::strerror(rv));
+      ok = false;
+    }
+  }
+
+  if (tuning.fifo_priority > 0) {
+    sched_param param;
+    param.sched_priority = tuning.fifo_priority;
+    const int rv = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (rv != 0) {
+      // usually needs an rtprio limit in /etc/security/limits.conf
+      FREI0R_WARN_STREAM("can't use SCHED_FIFO priority " << tuning.fifo_priority
+          << ": " << std::strerror(rv));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool lockMemory()
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    FREI0R_WARN_STREAM("can't lock memory, raise the memlock limit: " << std::strerror(errno));
+    return false;
+  }
+  FREI0R_INFO_STREAM("memory locked");
+  return true;
+}
+
+void prefault(void* data, const size_t size)
+{
+  if (!data) {
+    return;
+  }
+  const size_t page = sysconf(_SC_PAGESIZE);
+  // writing back what is there works for frames already in use too
+  volatile unsigned char* bytes = static_cast<unsigned char*>(data);
+  for (size_t i = 0; i < size; i += page) {
+    bytes[i] = bytes[i];
+  }
+  if (size > 0) {
+    bytes[size - 1] = bytes[size - 1];
+  }
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,571 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dlfcn.h>
+#include <experimental/filesystem>
+#include <fcntl.h>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/remote_plugin.hpp>
+#include <poll.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace frei0r_image
+{
+
+namespace
+{
+// only here so dladdr can find which library this is
+void locateLibrary()
+{
+}
+
+std::string defaultWorkerPath()
+{
+  Dl_info dl_info;
+  if (!dladdr(reinterpret_cast<void*>(&locateLibrary), &dl_info) || !dl_info.dli_fname) {
+    return "frei0r_worker";
+  }
+  // catkin puts executables in a directory named after the package,
+  // next to the libraries
+  const std::experimental::filesystem::path lib_path(dl_info.dli_fname);
+  return (lib_path.parent_path() / "frei0r_image" / "frei0r_worker").string();
+}
+
+bool sendAll(const int fd, const void* data, size_t size)
+{
+  auto bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    // MSG_NOSIGNAL so a dead worker is an error return instead of SIGPIPE
+    const ssize_t rv = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+bool recvAll(const int fd, void* data, size_t size, const double timeout)
+{
+  auto bytes = static_cast<uint8_t*>(data);
+  const auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+  while (size > 0) {
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        end - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0) {
+      return false;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    const int prv = poll(&pfd, 1, remaining);
+    if (prv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (prv == 0) {
+      return false;
+    }
+    const ssize_t rv = recv(fd, bytes, size, 0);
+    if (rv <= 0) {
+      if ((rv < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return false;
+    }
+    bytes += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+// split a reply made of several nul terminated strings
+std::vector<std::string> splitText(const std::string& text)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start < text.size()) {
+    const size_t end = text.find('\0', start);
+    if (end == std::string::npos) {
+      parts.push_back(text.substr(start));
+      break;
+    }
+    parts.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  return parts;
+}
+}  // namespace
+
+RemoteWorker::RemoteWorker(const std::string& plugin_path, const WorkerConfig& config) :
+  plugin_path_(plugin_path),
+  config_(config)
+{
+  worker_path_ = config_.worker_path.empty() ? defaultWorkerPath() : config_.worker_path;
+  for (int i = 0; i < std::max(config_.processes, 1); ++i) {
+    processes_.push_back(std::make_unique<Process>());
+  }
+  // every process loads the same plugin, the first one describes it
+  Process& first = *processes_[0];
+  std::lock_guard<std::mutex> lock(first.mutex);
+  start(first);
+
+  WorkerRequest request = {};
+  request.op = WORKER_INFO;
+  WorkerReply reply;
+  std::string text;
+  if (!call(first, request, "", reply, text) || (reply.status != 0)) {
+    stop(first);
+    throw std::runtime_error("worker couldn't load plugin");
+  }
+  const auto parts = splitText(text);
+  name_ = parts.size() > 0 ? parts[0] : "";
+  author_ = parts.size() > 1 ? parts[1] : "";
+  explanation_ = parts.size() > 2 ? parts[2] : "";
+  fi_.name = name_.c_str();
+  fi_.author = author_.c_str();
+  fi_.explanation = explanation_.c_str();
+  fi_.plugin_type = reply.ints[0];
+  fi_.color_model = reply.ints[1];
+  fi_.frei0r_version = reply.ints[2];
+  fi_.major_version = reply.ints[3];
+  fi_.minor_version = reply.ints[4];
+  fi_.num_params = reply.ints[5];
+
+  param_names_.resize(fi_.num_params);
+  param_explanations_.resize(fi_.num_params);
+  param_infos_.resize(fi_.num_params);
+  for (int i = 0; i < fi_.num_params; ++i) {
+    request.op = WORKER_PARAM_INFO;
+    request.index = i;
+    if (!call(first, request, "", reply, text)) {
+      stop(first);
+      throw std::runtime_error("worker died getting param info");
+    }
+    const auto param_parts = splitText(text);
+    param_names_[i] = param_parts.size() > 0 ? param_parts[0] : "";
+    param_explanations_[i] = param_parts.size() > 1 ? param_parts[1] : "";
+    param_infos_[i].type = reply.ints[0];
+  }
+  // the strings don't move once every one has been resized
+  for (int i = 0; i < fi_.num_params; ++i) {
+    param_infos_[i].name = param_names_[i].c_str();
+    param_infos_[i].explanation = param_explanations_[i].c_str();
+  }
+  for (size_t i = 1; i < processes_.size(); ++i) {
+    std::lock_guard<std::mutex> process_lock(processes_[i]->mutex);
+    try {
+      start(*processes_[i]);
+    } catch (std::runtime_error& ex) {
+      for (size_t j = 0; j < i; ++j) {
+        stop(*processes_[j]);
+      }
+      throw;
+    }
+  }
+}
+
+RemoteWorker::~RemoteWorker()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!remotes_.empty()) {
+      auto& remote = remotes_.begin()->second;
+      munmap(remote->frames, remote->frame_size * worker_num_frames);
+      shm_unlink(remote->shm_name.c_str());
+      remotes_.erase(remotes_.begin());
+    }
+  }
+  for (auto& process : processes_) {
+    std::lock_guard<std::mutex> lock(process->mutex);
+    stop(*process);
+  }
+}
+
+void RemoteWorker::start(Process& process)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    throw std::runtime_error("couldn't create worker socket");
+  }
+  // build everything the child needs before forking, only async signal
+  // safe calls are allowed in it before exec
+  const std::string fd_arg = std::to_string(fds[1]);
+  const char* argv[] = {worker_path_.c_str(), fd_arg.c_str(), plugin_path_.c_str(), nullptr};
+
+  process.pid = fork();
+  if (process.pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error("couldn't fork worker");
+  }
+  if (process.pid == 0) {
+    // No PR_SET_PDEATHSIG, it fires when the thread that forked exits,
+    // which could be any pool or callback thread. The worker watches for
+    // its parent going away itself.
+    fcntl(fds[1], F_SETFD, 0);
+    execv(argv[0], const_cast<char* const*>(argv));
+    _exit(127);
+  }
+  close(fds[1]);
+  process.fd = fds[0];
+  FREI0R_INFO_STREAM("started worker " << process.pid << " " << worker_path_ << " for "
+      << plugin_path_);
+}
+
+void RemoteWorker::stop(Process& process)
+{
+  if (process.fd >= 0) {
+    close(process.fd);
+    process.fd = -1;
+  }
+  if (process.pid > 0) {
+    // closing the socket is enough for a healthy worker to exit,
+    // a hung one won't notice
+    kill(process.pid, SIGKILL);
+    waitpid(process.pid, nullptr, 0);
+    process.pid = -1;
+  }
+}
+
+bool RemoteWorker::restart(Process& process)
+{
+  FREI0R_WARN_STREAM("restarting worker " << process.pid << " for " << plugin_path_);
+  stop(process);
+  process.broken = true;
+  try {
+    start(process);
+  } catch (std::runtime_error& ex) {
+    FREI0R_ERROR_STREAM(ex.what());
+    return false;
+  }
+  process.broken = false;
+  std::vector<Remote*> remotes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& pair : remotes_) {
+      if (pair.second->process == &process) {
+        remotes.push_back(pair.second.get());
+      }
+    }
+  }
+  // the rest still get rebuilt when one fails
+  for (const auto remote : remotes) {
+    if (!constructRemote(*remote)) {
+      FREI0R_ERROR_STREAM("couldn't rebuild instance " << remote->id << " in worker "
+          << process.pid << " for " << plugin_path_);
+      process.broken = true;
+      continue;
+    }
+    for (const auto& param : remote->params) {
+      setRemoteParam(*remote, param.first, param.second);
+    }
+  }
+  return !process.broken;
+}
+
+bool RemoteWorker::call(Process& process, const WorkerRequest& request, const std::string& text,
+    WorkerReply& reply, std::string& reply_text)
+{
+  const int fd = process.fd;
+  if (fd < 0) {
+    return false;
+  }
+  WorkerRequest msg = request;
+  msg.text_size = text.size();
+  if (!sendAll(fd, &msg, sizeof(msg)) || !sendAll(fd, text.data(), text.size())) {
+    FREI0R_ERROR_STREAM("worker for " << plugin_path_ << " went away");
+    return false;
+  }
+  if (!recvAll(fd, &reply, sizeof(reply), config_.timeout)) {
+    FREI0R_ERROR_STREAM("worker for " << plugin_path_ << " didn't reply to " << request.op
+        << " within " << config_.timeout << "s");
+    return false;
+  }
+  reply_text.resize(reply.text_size);
+  if (!recvAll(fd, &reply_text[0], reply_text.size(), config_.timeout)) {
+    return false;
+  }
+  return true;
+}
+
+bool RemoteWorker::constructRemote(const Remote& remote)
+{
+  WorkerRequest request = {};
+  request.op = WORKER_CONSTRUCT;
+  request.id = remote.id;
+  request.width = remote.width;
+  request.height = remote.height;
+  WorkerReply reply;
+  std::string text;
+  return call(*remote.process, request, remote.shm_name, reply, text) && (reply.status == 0);
+}
+
+void RemoteWorker::setRemoteParam(const Remote& remote, const int param_index,
+    const ParamValue& value)
+{
+  WorkerRequest request = {};
+  request.op = WORKER_SET_PARAM;
+  request.id = remote.id;
+  request.index = param_index;
+  std::copy(value.values, value.values + 4, request.values);
+  WorkerReply reply;
+  std::string text;
+  call(*remote.process, request, value.text, reply, text);
+}
+
+RemoteWorker::Remote* RemoteWorker::remote(f0r_instance_t instance)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto remote = static_cast<Remote*>(instance);
+  if (!remote || (remotes_.count(remote->id) == 0)) {
+    return nullptr;
+  }
+  return remote;
+}
+
+void RemoteWorker::getParamInfo(f0r_param_info_t* info, int param_index) const
+{
+  if ((param_index < 0) || (param_index >= static_cast<int>(param_infos_.size()))) {
+    return;
+  }
+  *info = param_infos_[param_index];
+}
+
+f0r_instance_t RemoteWorker::construct(unsigned int width, unsigned int height)
+{
+  auto remote = std::make_unique<Remote>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    remote->id = next_id_++;
+  }
+  remote->process = processes_[remote->id % processes_.size()].get();
+  remote->width = width;
+  remote->height = height;
+  remote->frame_size = width * height * 4;
+  remote->shm_name = "/frei0r_worker_" + std::to_string(getpid()) + "_" +
+      std::to_string(reinterpret_cast<uintptr_t>(this)) + "_" + std::to_string(remote->id);
+
+  const size_t size = remote->frame_size * worker_num_frames;
+  const int fd = shm_open(remote->shm_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+  if (fd < 0) {
+    FREI0R_ERROR_STREAM("couldn't create " << remote->shm_name);
+    return nullptr;
+  }
+  void* frames = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    frames = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (frames == MAP_FAILED) {
+    shm_unlink(remote->shm_name.c_str());
+    FREI0R_ERROR_STREAM("couldn't map " << remote->shm_name);
+    return nullptr;
+  }
+  remote->frames = static_cast<uint8_t*>(frames);
+
+  Process& process = *remote->process;
+  std::lock_guard<std::mutex> process_lock(process.mutex);
+  // restart rebuilds what it can of the others even if one of them fails
+  if (!constructRemote(*remote) && !(restart(process), constructRemote(*remote))) {
+    munmap(remote->frames, size);
+    shm_unlink(remote->shm_name.c_str());
+    return nullptr;
+  }
+  f0r_instance_t instance = remote.get();
+  std::lock_guard<std::mutex> lock(mutex_);
+  remotes_[remote->id] = std::move(remote);
+  return instance;
+}
+
+void RemoteWorker::destruct(f0r_instance_t instance)
+{
+  Remote* remote = this->remote(instance);
+  if (!remote) {
+    return;
+  }
+  Process& process = *remote->process;
+  std::unique_ptr<Remote> owned;
+  {
+    std::lock_guard<std::mutex> process_lock(process.mutex);
+    WorkerRequest request = {};
+    request.op = WORKER_DESTRUCT;
+    request.id = remote->id;
+    WorkerReply reply;
+    std::string text;
+    if (!call(process, request, "", reply, text)) {
+      restart(process);
+    }
+    // out of remotes_ before letting go of the process, so a restart
+    // doesn't rebuild it
+    std::lock_guard<std::mutex> lock(mutex_);
+    owned = std::move(remotes_[remote->id]);
+    remotes_.erase(remote->id);
+  }
+  munmap(owned->frames, owned->frame_size * worker_num_frames);
+  shm_unlink(owned->shm_name.c_str());
+}
+
+void RemoteWorker::setParamValue(f0r_instance_t instance, f0r_param_t param, int param_index)
+{
+  Remote* remote = this->remote(instance);
+  if (!remote || (param_index < 0) || (param_index >= static_cast<int>(param_infos_.size()))) {
+    return;
+  }
+  std::lock_guard<std::mutex> process_lock(remote->process->mutex);
+  ParamValue value;
+  switch (param_infos_[param_index].type) {
+    case (F0R_PARAM_BOOL):
+    case (F0R_PARAM_DOUBLE): {
+      value.values[0] = *static_cast<double*>(param);
+      break;
+    }
+    case (F0R_PARAM_COLOR): {
+      auto color = static_cast<f0r_param_color_t*>(param);
+      value.values[0] = color->r;
+      value.values[1] = color->g;
+      value.values[2] = color->b;
+      break;
+    }
+    case (F0R_PARAM_POSITION): {
+      auto pos = static_cast<f0r_param_position_t*>(param);
+      value.values[0] = pos->x;
+      value.values[1] = pos->y;
+      break;
+    }
+    case (F0R_PARAM_STRING): {
+      value.text = *static_cast<f0r_param_string*>(param);
+      break;
+    }
+  }
+  remote->params[param_index] = value;
+  setRemoteParam(*remote, param_index, value);
+}
+
+void RemoteWorker::getParamValue(f0r_instance_t instance, f0r_param_t param, int param_index)
+{
+  Remote* remote = this->remote(instance);
+  if (!remote || (param_index < 0) || (param_index >= static_cast<int>(param_infos_.size()))) {
+    return;
+  }
+  std::lock_guard<std::mutex> process_lock(remote->process->mutex);
+  // values this side set are known, anything else can change inside the
+  // plugin so it is asked every time
+  const ParamValue* value = nullptr;
+  auto set = remote->params.find(param_index);
+  if (set != remote->params.end()) {
+    value = &set->second;
+  } else {
+    WorkerRequest request = {};
+    request.op = WORKER_GET_PARAM;
+    request.id = remote->id;
+    request.index = param_index;
+    WorkerReply reply;
+    std::string text;
+    if (!call(*remote->process, request, "", reply, text)) {
+      restart(*remote->process);
+      return;
+    }
+    // a string result points in here, like a plugin pointing into its own state
+    ParamValue& read = remote->reads[param_index];
+    std::copy(reply.values, reply.values + 4, read.values);
+    read.text = text;
+    value = &read;
+  }
+  switch (param_infos_[param_index].type) {
+    case (F0R_PARAM_BOOL):
+    case (F0R_PARAM_DOUBLE): {
+      *static_cast<double*>(param) = value->values[0];
+      break;
+    }
+    case (F0R_PARAM_COLOR): {
+      auto color = static_cast<f0r_param_color_t*>(param);
+      color->r = value->values[0];
+      color->g = value->values[1];
+      color->b = value->values[2];
+      break;
+    }
+    case (F0R_PARAM_POSITION): {
+      auto pos = static_cast<f0r_param_position_t*>(param);
+      pos->x = value->values[0];
+      pos->y = value->values[1];
+      break;
+    }
+    case (F0R_PARAM_STRING): {
+      *static_cast<f0r_param_string*>(param) = const_cast<char*>(value->text.c_str());
+      break;
+    }
+  }
+}
+
+uint32_t* RemoteWorker::frame(f0r_instance_t instance, const int ind)
+{
+  Remote* remote = this->remote(instance);
+  if (!remote || (ind < 0) || (ind >= worker_num_frames)) {
+    return nullptr;
+  }
+  return reinterpret_cast<uint32_t*>(remote->frames + ind * remote->frame_size);
+}
+
+bool RemoteWorker::update(f0r_instance_t instance, double time,
+    const uint32_t* inframe1, const uint32_t* inframe2, const uint32_t* inframe3,
+    uint32_t* outframe)
+{
+  Remote* remote = this->remote(instance);
+  if (!remote) {
+    return false;
+  }
+  // only instances in the same process wait on each other here
+  std::lock_guard<std::mutex> process_lock(remote->process->mutex);
+  if (remote->process->broken && !restart(*remote->process)) {
+    return false;
+  }
+  const uint32_t* inframes[3] = {inframe1, inframe2, inframe3};
+  WorkerRequest request = {};
+  request.op = WORKER_UPDATE;
+  request.id = remote->id;
+  request.time = time;
+  // which inputs are present
+  request.index = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (!inframes[i]) {
+      continue;
+    }
+    request.index |= 1 << i;
+    uint8_t* dst = remote->frames + i * remote->frame_size;
+    if (reinterpret_cast<const uint8_t*>(inframes[i]) != dst) {
+      std::memcpy(dst, inframes[i], remote->frame_size);
+    }
+  }
+
+  WorkerReply reply;
+  std::string text;
+  if (!call(*remote->process, request, "", reply, text)) {
+    // this frame is lost, the next one goes to the replacement
+    restart(*remote->process);
+    return false;
+  }
+  const uint8_t* src = remote->frames + worker_out_frame * remote->frame_size;
+  if (outframe && (reinterpret_cast<uint8_t*>(outframe) != src)) {
+    std::memcpy(outframe, src, remote->frame_size);
+  }
+  return reply.status == 0;
+}
+
+}  // namespace frei0r_image
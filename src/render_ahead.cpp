@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/render_ahead.hpp>
+#include <stdexcept>
+#include <string>
+
+namespace frei0r_image
+{
+
+RenderAhead::RenderAhead(Plugin& plugin, const unsigned int width, const unsigned int height,
+    const size_t depth, ThreadPool* pool) :
+  width_(width),
+  height_(height),
+  pool_(pool)
+{
+  instance_ = plugin.newInstance(width_, height_);
+  if (!instance_ || !instance_->instance_) {
+    throw std::runtime_error("no instance to render ahead with");
+  }
+  ring_.resize(std::max(depth, static_cast<size_t>(1)));
+  for (auto& frame : ring_) {
+    frame.data.resize(width_ * height_);
+  }
+  FREI0R_INFO_STREAM("rendering up to " << ring_.size() << " frames ahead");
+}
+
+RenderAhead::~RenderAhead()
+{
+  stop();
+}
+
+void RenderAhead::stop()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  stopping_ = true;
+  // queued renders see stopping_ and don't touch the instance
+  cond_.wait(lock, [this] { return !running_; });
+}
+
+void RenderAhead::copyParams(Instance& from)
+{
+  ParamValues values;
+  values.read(from);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (params_valid_ && (values == params_)) {
+    return;
+  }
+  params_ = values;
+  params_valid_ = true;
+  ++generation_;
+  // whatever is being rendered now gets dropped when it is done
+  read_ = (read_ + count_) % ring_.size();
+  count_ = 0;
+}
+
+void RenderAhead::applyParams()
+{
+  ParamValues values;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!params_valid_ || (applied_valid_ && (params_ == applied_))) {
+      return;
+    }
+    values = params_;
+  }
+  values.write(*instance_, applied_valid_ ? &applied_ : nullptr);
+  applied_ = values;
+  applied_valid_ = true;
+}
+
+void RenderAhead::schedule()
+{
+  if (rendering_ || stopping_ || !pool_ || (count_ >= ring_.size())) {
+    return;
+  }
+  rendering_ = true;
+  std::weak_ptr<RenderAhead> weak = weak_from_this();
+  // below updates, which need their frames now
+  const bool queued = pool_->submit([weak]() {
+    if (auto self = weak.lock()) {
+      self->renderNext();
+    }
+  }, -1);
+  if (!queued) {
+    rendering_ = false;
+  }
+}
+
+void RenderAhead::renderNext()
+{
+  size_t slot;
+  double time;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || (count_ >= ring_.size())) {
+      rendering_ = false;
+      return;
+    }
+    slot = (read_ + count_) % ring_.size();
+    time = next_time_;
+    generation = generation_;
+    running_ = true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(render_mutex_);
+    applyParams();
+    instance_->process(time, nullptr, nullptr, nullptr, ring_[slot].data.data());
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // update only ever takes frames from the front, so the slot after the
+  // rendered ones is still this one
+  if (generation == generation_) {
+    ring_[slot].time = time;
+    ++count_;
+    next_time_ = time + period_;
+  }
+  running_ = false;
+  rendering_ = false;
+  cond_.notify_all();
+  schedule();
+}
+
+void RenderAhead::update(const double time, const double period, uint32_t* out_frame)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    period_ = period;
+    const double tolerance = period * 0.5;
+    // anything older than this tick is never going to be wanted
+    while ((count_ > 0) && (ring_[read_].time < time - tolerance)) {
+      read_ = (read_ + 1) % ring_.size();
+      --count_;
+    }
+    if ((count_ > 0) && (std::abs(ring_[read_].time - time) <= tolerance)) {
+      std::copy(ring_[read_].data.begin(), ring_[read_].data.end(), out_frame);
+      read_ = (read_ + 1) % ring_.size();
+      --count_;
+      schedule();
+      return;
+    }
+    // behind or just started, render this one now and the rest from here
+    next_time_ = time + period;
+    read_ = (read_ + count_) % ring_.size();
+    count_ = 0;
+    ++generation_;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(render_mutex_);
+    applyParams();
+    instance_->process(time, nullptr, nullptr, nullptr, out_frame);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  schedule();
+}
+
+}  // namespace frei0r_image
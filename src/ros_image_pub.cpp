@@ -19,14 +19,24 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <cstring>
 #include <cv_bridge/cv_bridge.h>
+#include <deque>
+#include <frei0r_image/ShmFrame.h>
+#include <frei0r_image/ros_connection.hpp>
+#include <frei0r_image/shm_ring.hpp>
 #include <iostream>
 #include <memory>
-#include <ros/master.h>
+#include <mutex>
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
+#include <ros/spinner.h>
 #include <sensor_msgs/Image.h>
 #include <stdlib.h>
 #include <string>
+#include <thread>
+#include <vector>
 
 // This makes the library symbols not mangled,
 // e.g. 0000000000007dc0 T f0r_deinit instead of
@@ -41,34 +51,167 @@ typedef struct ros_image_pub_instance {
   std::string topic_ = "image_out";
   std::string frame_id_ = "frei0r";
 
-  bool initted_ = false;
-  std::unique_ptr<ros::NodeHandle> nh_;
+  // everything ros is set up by connection_ in the background,
+  // nh_ is set once it has connected
+  std::unique_ptr<frei0r_image::RosConnection> connection_;
+  ros::NodeHandle* nh_ = nullptr;
+  // guards pub_ between the host thread and the publishing thread
+  std::mutex pub_mutex_;
   ros::Publisher pub_;
 
-  void update(const unsigned char* inframe)
+  // publish descriptors to a shared memory ring on topic_ + "_shm" instead
+  bool use_shm_ = false;
+  std::unique_ptr<frei0r_image::ShmRingWriter> shm_writer_;
+
+  // The host only copies into a pooled message and queues it,
+  // publishing and the publisher's own callbacks happen on other threads.
+  ros::CallbackQueue callback_queue_;
+  std::unique_ptr<ros::AsyncSpinner> spinner_;
+  std::thread pub_thread_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cond_;
+  bool running_ = false;
+  // waiting to be published, oldest first, the oldest is dropped when full
+  std::deque<sensor_msgs::ImagePtr> queue_;
+  const size_t max_queued_ = 2;
+  // a message can be refilled once nothing but the pool refers to it
+  std::vector<sensor_msgs::ImagePtr> pool_;
+  const size_t max_pool_ = 8;
+  size_t dropped_ = 0;
+
+  ~ros_image_pub_instance()
   {
-    if (!nh_) {
-      if (!ros::master::check()) {
-        return;
-      }
-      int argc = 0;
-      // TODO(lucasw) this can go back in construct
-      ros::init(argc, nullptr, "frei0r", ros::init_options::AnonymousName);
-      ROS_INFO_STREAM("initialized ros node");
-      nh_ = std::make_unique<ros::NodeHandle>();
+    connection_->stop();
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      running_ = false;
+    }
+    queue_cond_.notify_all();
+    if (pub_thread_.joinable()) {
+      pub_thread_.join();
+    }
+    if (spinner_) {
+      spinner_->stop();
+    }
+    pub_.shutdown();
+    connection_ = nullptr;
+  }
+
+  void start()
+  {
+    nh_->setCallbackQueue(&callback_queue_);
+    spinner_ = std::make_unique<ros::AsyncSpinner>(1, &callback_queue_);
+    spinner_->start();
+    running_ = true;
+    pub_thread_ = std::thread(&ros_image_pub_instance::publishLoop, this);
+  }
+
+  void advertise()
+  {
+    std::lock_guard<std::mutex> lock(pub_mutex_);
+    pub_.shutdown();
+    shm_writer_ = nullptr;
+    if (topic_ == "") {
+      return;
+    }
+    if (use_shm_) {
+      pub_ = nh_->advertise<frei0r_image::ShmFrame>(topic_ + "_shm", 3);
+      shm_writer_ = std::make_unique<frei0r_image::ShmRingWriter>(
+          frei0r_image::shmName(ros::this_node::getName() + "/" + topic_), 4);
+    } else {
       pub_ = nh_->advertise<sensor_msgs::Image>(topic_, 3);
     }
-    sensor_msgs::Image image_out;
-    image_out.header.stamp = ros::Time::now();
-    image_out.header.frame_id = frame_id_;
-    image_out.width = width_;
-    image_out.height = height_;
-    image_out.step = width_ * 4;
-    image_out.encoding = "bgra8";
-    image_out.data.resize(image_out.step * height_);
-    std::copy(inframe, inframe + image_out.data.size(), &image_out.data[0]);
-    pub_.publish(image_out);
-    ros::spinOnce();
+  }
+
+  void publishShm(const unsigned char* inframe)
+  {
+    try {
+      cv::Mat frame = shm_writer_->beginWrite(width_, height_);
+      std::memcpy(frame.data, inframe, width_ * height_ * 4);
+      frei0r_image::ShmFrame desc;
+      shm_writer_->endWrite(ros::Time::now(), desc);
+      desc.header.frame_id = frame_id_;
+      std::lock_guard<std::mutex> lock(pub_mutex_);
+      pub_.publish(desc);
+    } catch (std::runtime_error& ex) {
+      ROS_ERROR_STREAM(ex.what());
+    }
+  }
+
+  sensor_msgs::ImagePtr acquire()
+  {
+    for (auto& msg : pool_) {
+      if (msg.use_count() == 1) {
+        return msg;
+      }
+    }
+    auto msg = boost::make_shared<sensor_msgs::Image>();
+    msg->header.frame_id = frame_id_;
+    msg->width = width_;
+    msg->height = height_;
+    msg->step = width_ * 4;
+    msg->encoding = "bgra8";
+    msg->data.resize(msg->step * height_);
+    // past the limit subscribers are holding on to a lot of frames,
+    // let those get freed instead of growing the pool
+    if (pool_.size() < max_pool_) {
+      pool_.push_back(msg);
+    }
+    return msg;
+  }
+
+  void publishLoop()
+  {
+    while (true) {
+      sensor_msgs::ImagePtr msg;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        queue_cond_.wait(lock, [this] { return !running_ || !queue_.empty(); });
+        if (!running_) {
+          return;
+        }
+        msg = queue_.front();
+        queue_.pop_front();
+      }
+      std::lock_guard<std::mutex> lock(pub_mutex_);
+      pub_.publish(sensor_msgs::ImageConstPtr(msg));
+    }
+  }
+
+  void connect()
+  {
+    connection_ = std::make_unique<frei0r_image::RosConnection>(
+        [this](ros::NodeHandle& nh) {
+          nh_ = &nh;
+          start();
+          advertise();
+        });
+  }
+
+  void update(const unsigned char* inframe, unsigned char* outframe)
+  {
+    if (!connection_->connected()) {
+      // nowhere to publish yet, at least let the host see the frame
+      std::memcpy(outframe, inframe, width_ * height_ * 4);
+      return;
+    }
+    if (shm_writer_) {
+      publishShm(inframe);
+      return;
+    }
+    auto msg = acquire();
+    msg->header.stamp = ros::Time::now();
+    std::memcpy(&msg->data[0], inframe, msg->data.size());
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      if (queue_.size() >= max_queued_) {
+        queue_.pop_front();
+        ++dropped_;
+        ROS_WARN_STREAM_THROTTLE(2.0, "publisher is behind, dropped " << dropped_);
+      }
+      queue_.push_back(msg);
+    }
+    queue_cond_.notify_one();
   }
 } ros_image_pub_instance_t;
 
@@ -90,7 +233,7 @@ void f0r_get_plugin_info(f0r_plugin_info_t *inverterInfo) {
   inverterInfo->frei0r_version = FREI0R_MAJOR_VERSION;
   inverterInfo->major_version = 0;
   inverterInfo->minor_version = 1;
-  inverterInfo->num_params = 1;
+  inverterInfo->num_params = 2;
   inverterInfo->explanation = "publishes to a ros image topic";
 }
 
@@ -101,6 +244,11 @@ void f0r_get_param_info(f0r_param_info_t *info, int param_index) {
     info->type = F0R_PARAM_STRING;
     info->explanation = "ros image topic";
     break;
+  case 1:
+    info->name = "shared memory";
+    info->type = F0R_PARAM_BOOL;
+    info->explanation = "publish shared memory frame descriptors on the topic + _shm";
+    break;
   }
 }
 
@@ -109,6 +257,7 @@ f0r_instance_t f0r_construct(unsigned int width, unsigned int height) {
 
   inst->width_ = width;
   inst->height_ = height;
+  inst->connect();
 
   ROS_INFO_STREAM("ros_image_pub construct " << ros::this_node::getName() << " "
       << width << " x " << height << " " << inst->topic_);
@@ -127,20 +276,30 @@ void f0r_set_param_value(f0r_instance_t instance, f0r_param_t param,
   ros_image_pub_instance_t *inst = reinterpret_cast<ros_image_pub_instance_t*>(instance);
 
   switch (param_index) {
-  case 0:
+  case 0: {
     const std::string topic = std::string(*(reinterpret_cast<char**>(param)));
+    auto lock = inst->connection_->lock();
     if (topic != inst->topic_) {
       inst->topic_ = topic;
       ROS_INFO_STREAM("new topic " << inst->topic_);
-      if (inst->nh_) {
-        inst->pub_.shutdown();
-        if (inst->topic_ != "") {
-          inst->pub_ = inst->nh_->advertise<sensor_msgs::Image>(inst->topic_, 3);
-        }
+      if (inst->connection_->connected()) {
+        inst->advertise();
       }
     }
     break;
   }
+  case 1: {
+    const bool use_shm = *(reinterpret_cast<f0r_param_bool*>(param)) >= 0.5;
+    auto lock = inst->connection_->lock();
+    if (use_shm != inst->use_shm_) {
+      inst->use_shm_ = use_shm;
+      if (inst->connection_->connected()) {
+        inst->advertise();
+      }
+    }
+    break;
+  }
+  }
 }
 
 void f0r_get_param_value(f0r_instance_t instance, f0r_param_t param,
@@ -154,6 +313,9 @@ void f0r_get_param_value(f0r_instance_t instance, f0r_param_t param,
     *(reinterpret_cast<f0r_param_string*>(param)) = const_cast<char*>(inst->topic_.data());
     ROS_INFO_STREAM("get param done");
     break;
+  case 1:
+    *(reinterpret_cast<f0r_param_bool*>(param)) = inst->use_shm_ ? 1.0 : 0.0;
+    break;
   }
 }
 
@@ -165,5 +327,6 @@ void f0r_update(f0r_instance_t instance, double time, const uint32_t *inframe,
   // TODO(lucasw) there is no frei0r 'sink' type, so need to do something with the output.
   // TODO(lucasw) should this be a copy instead?
   // outframe = inframe;
-  inst->update(reinterpret_cast<const unsigned char *>(inframe));
+  inst->update(reinterpret_cast<const unsigned char *>(inframe),
+      reinterpret_cast<unsigned char *>(outframe));
 }
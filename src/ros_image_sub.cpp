@@ -19,11 +19,17 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <cstring>
 #include <cv_bridge/cv_bridge.h>
+#include <frei0r_image/ShmFrame.h>
+#include <frei0r_image/ros_connection.hpp>
+#include <frei0r_image/shm_ring.hpp>
 #include <iostream>
 #include <memory>
-#include <ros/master.h>
+#include <mutex>
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
+#include <ros/spinner.h>
 #include <sensor_msgs/Image.h>
 #include <stdlib.h>
 #include <string>
@@ -37,9 +43,108 @@ typedef struct ros_image_sub_instance {
   unsigned int height_;
   std::string topic_ = "image_in";
 
-  std::unique_ptr<ros::NodeHandle> nh_;
+  // everything ros is set up by connection_ in the background,
+  // nh_ is set once it has connected
+  std::unique_ptr<frei0r_image::RosConnection> connection_;
+  ros::NodeHandle* nh_ = nullptr;
   ros::Subscriber sub_;
-  cv::Mat image_in_;
+
+  // Callbacks run on their own spinner thread and convert and resize each
+  // message once into the back frame, the host only copies out the front.
+  ros::CallbackQueue callback_queue_;
+  std::unique_ptr<ros::AsyncSpinner> spinner_;
+  // held while the front frame is read or swapped
+  std::mutex frame_mutex_;
+  cv::Mat frames_[2];
+  int front_ = 0;
+  bool has_frame_ = false;
+
+  // subscribe to shared memory frame descriptors on topic_ + "_shm" instead
+  bool use_shm_ = false;
+  frei0r_image::ShmRingReader shm_reader_;
+
+  ~ros_image_sub_instance()
+  {
+    connection_->stop();
+    if (spinner_) {
+      spinner_->stop();
+    }
+    sub_.shutdown();
+    connection_ = nullptr;
+  }
+
+  void allocate()
+  {
+    for (auto& frame : frames_) {
+      frame = cv::Mat(cv::Size(width_, height_), CV_8UC4, cv::Scalar(0, 0, 0, 0));
+    }
+  }
+
+  void connect()
+  {
+    connection_ = std::make_unique<frei0r_image::RosConnection>(
+        [this](ros::NodeHandle& nh) {
+          nh_ = &nh;
+          start();
+          subscribe();
+          ROS_INFO_STREAM("subscribed to " << topic_);
+        });
+  }
+
+  void start()
+  {
+    nh_->setCallbackQueue(&callback_queue_);
+    spinner_ = std::make_unique<ros::AsyncSpinner>(1, &callback_queue_);
+    spinner_->start();
+  }
+
+  void subscribe()
+  {
+    sub_.shutdown();
+    if (topic_ == "") {
+      return;
+    }
+    // TODO(lucasw) try in case topic is badly formatted?
+    if (use_shm_) {
+      sub_ = nh_->subscribe<frei0r_image::ShmFrame>(topic_ + "_shm", 3,
+          &ros_image_sub_instance::shmCallback, this);
+    } else {
+      sub_ = nh_->subscribe<sensor_msgs::Image>(topic_, 3,
+          &ros_image_sub_instance::imageCallback, this);
+    }
+  }
+
+  // only the spinner thread writes to the back frame
+  void storeFrame(const cv::Mat& image)
+  {
+    cv::Mat& back = frames_[1 - front_];
+    if ((image.cols == static_cast<int>(width_)) && (image.rows == static_cast<int>(height_))) {
+      image.copyTo(back);
+    } else {
+      cv::resize(image, back, back.size(), 0, 0, cv::INTER_NEAREST);
+    }
+  }
+
+  void swapFrames()
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    front_ = 1 - front_;
+    has_frame_ = true;
+  }
+
+  void shmCallback(const frei0r_image::ShmFrameConstPtr& msg)
+  {
+    cv::Mat view;
+    if (!shm_reader_.view(*msg, view)) {
+      return;
+    }
+    storeFrame(view);
+    // torn by the writer lapping the ring, keep showing the previous frame
+    if (!shm_reader_.valid(*msg)) {
+      return;
+    }
+    swapFrames();
+  }
 
   void imageCallback(const sensor_msgs::ImageConstPtr& msg)
   {
@@ -50,8 +155,19 @@ typedef struct ros_image_sub_instance {
       ROS_ERROR_THROTTLE(1.0, "cv bridge exception %s", ex.what());
       return;
     }
-    cv::resize(cv_ptr->image, image_in_,
-        cv::Size(width_, height_), cv::INTER_NEAREST);
+    storeFrame(cv_ptr->image);
+    swapFrames();
+  }
+
+  void copyFrame(unsigned char* dst)
+  {
+    const size_t num_bytes = width_ * height_ * 4;
+    std::lock_guard<std::mutex> lock(frame_mutex_);
+    if (!has_frame_) {
+      std::memset(dst, 0, num_bytes);
+      return;
+    }
+    std::memcpy(dst, frames_[front_].data, num_bytes);
   }
 } ros_image_sub_instance_t;
 
@@ -63,8 +179,6 @@ unsigned char CLAMP0255(int32_t a) {
 }
 
 int f0r_init() {
-  int argc = 0;
-  ros::init(argc, nullptr, "frei0r", ros::init_options::AnonymousName);
   ROS_INFO_STREAM("ros_image_sub init " << ros::this_node::getName());
   return 1;
 }
@@ -81,7 +195,7 @@ void f0r_get_plugin_info(f0r_plugin_info_t *inverterInfo) {
   inverterInfo->frei0r_version = FREI0R_MAJOR_VERSION;
   inverterInfo->major_version = 0;
   inverterInfo->minor_version = 1;
-  inverterInfo->num_params = 1;
+  inverterInfo->num_params = 2;
   inverterInfo->explanation = "subscribes to a ros image topic";
 }
 
@@ -92,6 +206,11 @@ void f0r_get_param_info(f0r_param_info_t *info, int param_index) {
     info->type = F0R_PARAM_STRING;
     info->explanation = "ros image topic";
     break;
+  case 1:
+    info->name = "shared memory";
+    info->type = F0R_PARAM_BOOL;
+    info->explanation = "subscribe to shared memory frame descriptors on the topic + _shm";
+    break;
   }
 }
 
@@ -100,6 +219,8 @@ f0r_instance_t f0r_construct(unsigned int width, unsigned int height) {
 
   inst->width_ = width;
   inst->height_ = height;
+  inst->allocate();
+  inst->connect();
 
   ROS_INFO_STREAM("ros_image_sub construct " << ros::this_node::getName() << " "
       << width << " x " << height << " " << inst->topic_);
@@ -118,24 +239,32 @@ void f0r_set_param_value(f0r_instance_t instance, f0r_param_t param,
   ros_image_sub_instance_t *inst = reinterpret_cast<ros_image_sub_instance_t*>(instance);
 
   switch (param_index) {
-  case 0:
+  case 0: {
     const std::string topic = std::string(*(reinterpret_cast<char**>(param)));
     // inst->topic_ = (*(char**)(param));
     // std::cout << inst->topic_ << "\n";
+    auto lock = inst->connection_->lock();
     if (topic != inst->topic_) {
       inst->topic_ = topic;
       ROS_INFO_STREAM("new topic " << inst->topic_);
-      if (inst->nh_) {
-        inst->sub_.shutdown();
-        if (inst->topic_ != "") {
-          // TODO(lucasw) try in case topic is badly formatted?
-          inst->sub_ = inst->nh_->subscribe<sensor_msgs::Image>(inst->topic_, 3,
-              &ros_image_sub_instance::imageCallback, inst);
-        }
+      if (inst->connection_->connected()) {
+        inst->subscribe();
       }
     }
     break;
   }
+  case 1: {
+    const bool use_shm = *(reinterpret_cast<f0r_param_bool*>(param)) >= 0.5;
+    auto lock = inst->connection_->lock();
+    if (use_shm != inst->use_shm_) {
+      inst->use_shm_ = use_shm;
+      if (inst->connection_->connected()) {
+        inst->subscribe();
+      }
+    }
+    break;
+  }
+  }
 }
 
 void f0r_get_param_value(f0r_instance_t instance, f0r_param_t param,
@@ -149,6 +278,9 @@ void f0r_get_param_value(f0r_instance_t instance, f0r_param_t param,
     *(reinterpret_cast<f0r_param_string*>(param)) = const_cast<char*>(inst->topic_.data());
     ROS_INFO_STREAM("get param done");
     break;
+  case 1:
+    *(reinterpret_cast<f0r_param_bool*>(param)) = inst->use_shm_ ? 1.0 : 0.0;
+    break;
   }
 }
 
@@ -158,33 +290,6 @@ void f0r_update(f0r_instance_t instance, double time, const uint32_t *inframe,
   ros_image_sub_instance_t *inst = reinterpret_cast<ros_image_sub_instance_t*>(instance);
 
   unsigned char *dst = reinterpret_cast<unsigned char *>(outframe);
-
-  if (!inst->nh_) {
-    if (!ros::master::check()) {
-      return;
-    }
-    inst->nh_ = std::make_unique<ros::NodeHandle>();
-    inst->sub_ = inst->nh_->subscribe<sensor_msgs::Image>(inst->topic_, 3,
-        &ros_image_sub_instance::imageCallback, inst);
-    ROS_INFO_STREAM("subscribed to " << inst->topic_);
-  }
-
-  ros::spinOnce();
-
-  if (inst->image_in_.empty()) {
-    ROS_INFO_STREAM("blank image");
-    inst->image_in_ = cv::Mat(cv::Size(inst->width_, inst->height_),
-                              CV_8UC4, cv::Scalar(0, 0, 0, 0));
-  }
-
-  cv::Mat tmp = inst->image_in_;
-  if ((inst->image_in_.cols != inst->width_) ||
-      (inst->image_in_.rows != inst->height_)) {
-    ROS_WARN_STREAM("size mismatch ");
-    cv::resize(inst->image_in_, tmp,
-        cv::Size(inst->width_, inst->height_), cv::INTER_NEAREST);
-  }
-
-  const size_t num_bytes = inst->width_ * inst->height_ * 4;
-  std::copy(&tmp.data[0], &tmp.data[0] + num_bytes, dst);
+  // blank until connected and a frame arrives, nothing here waits on ros
+  inst->copyFrame(dst);
 }
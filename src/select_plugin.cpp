@@ -7,6 +7,7 @@
 #include <dlfcn.h>
 #include <frei0r.h>
 #include <frei0r_image/LoadPlugin.h>
+#include <frei0r_image/builtin.hpp>
 #include <frei0r_image/frei0r_image.hpp>
 #include <map>
 #include <memory>
@@ -19,6 +20,16 @@ namespace frei0r_image
 
 bool getPluginInfo(const std::string& name, std::string& plugin_name, int& plugin_type)
 {
+  if (isBuiltin(name)) {
+    try {
+      Plugin plugin(name);
+      plugin_name = sanitize(plugin.fi_.name);
+      plugin_type = plugin.fi_.plugin_type;
+      return true;
+    } catch (std::runtime_error& ex) {
+      return false;
+    }
+  }
   void* handle = dlopen(name.c_str(), RTLD_NOW);
   if (!handle) {
     return false;
@@ -66,6 +77,14 @@ struct Selector
     } else {
       getPluginsFromParam();
     }
+    // always offered, next to whatever was found
+    for (const auto& builtin : builtinNames()) {
+      std::string name;
+      int plugin_type = 0;
+      if (getPluginInfo(builtin, name, plugin_type)) {
+        enum_map_[plugin_type]["builtin_" + name] = builtin;
+      }
+    }
 
     ddr_ = std::make_unique<ddynamic_reconfigure::DDynamicReconfigure>(private_nh_);
     for (const auto& pair : enum_map_) {
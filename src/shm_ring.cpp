@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <frei0r_image/shm_ring.hpp>
+#include <new>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace frei0r_image
+{
+
+namespace
+{
+const uint32_t shm_magic = 0xf0e1da7a;
+// keep every slot header and pixel block on its own cache lines
+const size_t align = 64;
+const size_t ring_header_size = align;
+const size_t slot_header_size = align;
+
+size_t alignUp(const size_t size)
+{
+  return (size + align - 1) / align * align;
+}
+
+size_t slotStride(const size_t slot_size)
+{
+  return slot_header_size + alignUp(slot_size);
+}
+
+// Segments named base_name_<pid>_<generation> whose writer process is gone,
+// left behind by a crash. They live in /dev/shm without the leading /.
+void removeStale(const std::string& base_name)
+{
+  const std::string prefix = base_name.substr(1) + "_";
+  DIR* dir = opendir("/dev/shm");
+  if (!dir) {
+    return;
+  }
+  std::vector<std::string> stale;
+  while (const struct dirent* entry = readdir(dir)) {
+    const std::string file = entry->d_name;
+    if (file.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    const std::string rest = file.substr(prefix.size());
+    const size_t underscore = rest.find('_');
+    if ((underscore == 0) || (underscore == std::string::npos) ||
+        (rest.find_first_not_of("0123456789_") != std::string::npos) ||
+        (rest.find('_', underscore + 1) != std::string::npos)) {
+      continue;
+    }
+    const pid_t pid = std::atoi(rest.c_str());
+    if ((kill(pid, 0) != 0) && (errno == ESRCH)) {
+      stale.push_back("/" + file);
+    }
+  }
+  closedir(dir);
+  for (const auto& name : stale) {
+    if (shm_unlink(name.c_str()) == 0) {
+      ROS_INFO_STREAM("removed stale shm ring " << name);
+    }
+  }
+}
+}  // namespace
+
+std::string shmName(const std::string& ros_name)
+{
+  std::string name = "/frei0r";
+  for (const char c : ros_name) {
+    name += std::isalnum(c) ? c : '_';
+  }
+  return name;
+}
+
+ShmRingWriter::ShmRingWriter(const std::string& base_name, const size_t num_slots) :
+  base_name_(base_name),
+  num_slots_(num_slots)
+{
+  if (num_slots_ < 2) {
+    num_slots_ = 2;
+  }
+  removeStale(base_name_);
+}
+
+ShmRingWriter::~ShmRingWriter()
+{
+  destroy();
+}
+
+void ShmRingWriter::create(const size_t slot_size)
+{
+  destroy();
+  name_ = base_name_ + "_" + std::to_string(getpid()) + "_" + std::to_string(generation_++);
+  size_ = ring_header_size + num_slots_ * slotStride(slot_size);
+
+  // readers have to run as the same user
+  const int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't create shm segment " + name_);
+  }
+  if (ftruncate(fd, size_) != 0) {
+    ::close(fd);
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("couldn't size shm segment " + name_);
+  }
+  data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("couldn't map shm segment " + name_);
+  }
+
+  header_ = new (data_) ShmRingHeader;
+  header_->num_slots = num_slots_;
+  header_->slot_size = alignUp(slot_size);
+  header_->write_count.store(0);
+  for (size_t i = 0; i < num_slots_; ++i) {
+    auto slot_data = static_cast<uint8_t*>(data_) + ring_header_size + i * slotStride(slot_size);
+    auto slot = new (slot_data) ShmSlotHeader;
+    slot->seq.store(0);
+  }
+  // readers check this last
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = shm_magic;
+  ROS_INFO_STREAM("created shm ring " << name_ << " " << num_slots_ << " x " << slot_size);
+}
+
+void ShmRingWriter::destroy()
+{
+  if (!data_) {
+    return;
+  }
+  munmap(data_, size_);
+  // readers that already have it mapped keep it until they move on
+  shm_unlink(name_.c_str());
+  data_ = nullptr;
+  header_ = nullptr;
+  slot_ = nullptr;
+}
+
+cv::Mat ShmRingWriter::beginWrite(const unsigned int width, const unsigned int height)
+{
+  const size_t step = width * 4;
+  const size_t frame_size = step * height;
+  if ((!header_) || (header_->slot_size < frame_size)) {
+    create(frame_size);
+  }
+
+  const uint64_t count = header_->write_count.load(std::memory_order_relaxed);
+  slot_ind_ = count % header_->num_slots;
+  auto slot_data = static_cast<uint8_t*>(data_) + ring_header_size +
+      slot_ind_ * slotStride(header_->slot_size);
+  slot_ = reinterpret_cast<ShmSlotHeader*>(slot_data);
+  // odd: readers treat anything in this slot as torn until endWrite
+  slot_->seq.fetch_add(1, std::memory_order_acq_rel);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot_->width = width;
+  slot_->height = height;
+  slot_->step = step;
+  return cv::Mat(height, width, CV_8UC4, slot_data + slot_header_size, step);
+}
+
+void ShmRingWriter::endWrite(const ros::Time& stamp, ShmFrame& desc)
+{
+  if (!slot_) {
+    return;
+  }
+  const uint64_t seq = slot_->seq.fetch_add(1, std::memory_order_release) + 1;
+  header_->write_count.fetch_add(1, std::memory_order_release);
+
+  desc.header.stamp = stamp;
+  desc.segment = name_;
+  desc.slot = slot_ind_;
+  desc.seq = seq;
+  desc.width = slot_->width;
+  desc.height = slot_->height;
+  desc.step = slot_->step;
+  desc.encoding = "bgra8";
+  slot_ = nullptr;
+}
+
+ShmRingReader::~ShmRingReader()
+{
+  close();
+}
+
+bool ShmRingReader::open(const std::string& name)
+{
+  close();
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < ring_header_size)) {
+    ::close(fd);
+    return false;
+  }
+  data_ = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    return false;
+  }
+  size_ = st.st_size;
+  header_ = static_cast<const ShmRingHeader*>(data_);
+  if (header_->magic != shm_magic) {
+    close();
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  name_ = name;
+  return true;
+}
+
+void ShmRingReader::close()
+{
+  if (data_) {
+    munmap(data_, size_);
+  }
+  name_ = "";
+  data_ = nullptr;
+  header_ = nullptr;
+  size_ = 0;
+}
+
+const ShmSlotHeader* ShmRingReader::slot(const uint32_t ind) const
+{
+  if ((!header_) || (ind >= header_->num_slots)) {
+    return nullptr;
+  }
+  const size_t offset = ring_header_size + ind * slotStride(header_->slot_size);
+  if (offset + slotStride(header_->slot_size) > size_) {
+    return nullptr;
+  }
+  return reinterpret_cast<const ShmSlotHeader*>(static_cast<const uint8_t*>(data_) + offset);
+}
+
+bool ShmRingReader::view(const ShmFrame& desc, cv::Mat& image)
+{
+  if ((desc.segment != name_) && !open(desc.segment)) {
+    ROS_WARN_STREAM_THROTTLE(2.0, "couldn't open shm segment '" << desc.segment << "'");
+    return false;
+  }
+  const ShmSlotHeader* slot_header = slot(desc.slot);
+  if (!slot_header) {
+    return false;
+  }
+  if ((static_cast<size_t>(desc.step) * desc.height > header_->slot_size) ||
+      (desc.step < desc.width * 4)) {
+    return false;
+  }
+  if (slot_header->seq.load(std::memory_order_acquire) != desc.seq) {
+    return false;
+  }
+  auto pixels = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(slot_header) +
+      slot_header_size);
+  image = cv::Mat(desc.height, desc.width, CV_8UC4, pixels, desc.step);
+  return true;
+}
+
+bool ShmRingReader::valid(const ShmFrame& desc) const
+{
+  if (desc.segment != name_) {
+    return false;
+  }
+  const ShmSlotHeader* slot_header = slot(desc.slot);
+  if (!slot_header) {
+    return false;
+  }
+  // order the reads of the pixels before the re-check of the sequence
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot_header->seq.load(std::memory_order_relaxed) == desc.seq;
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/thread_pool.hpp>
+#include <utility>
+
+namespace frei0r_image
+{
+
+namespace
+{
+// which queue a task submitted from inside a worker should land on,
+// so follow on work stays on the core that made it
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads, size_t max_queued, const ThreadTuning& tuning) :
+  max_queued_(std::max(max_queued, static_cast<size_t>(1))),
+  tuning_(tuning)
+{
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::run, this, i);
+  }
+  FREI0R_INFO_STREAM("thread pool with " << num_threads << " workers, "
+      << max_queued_ << " max queued");
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    running_ = false;
+  }
+  wait_cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool ThreadPool::submit(std::function<void()> fn, const int priority)
+{
+  if (queued_.fetch_add(1) >= max_queued_) {
+    queued_.fetch_sub(1);
+    return false;
+  }
+
+  size_t index;
+  if (current_pool == this) {
+    index = current_index;
+  } else {
+    index = next_queue_.fetch_add(1) % queues_.size();
+  }
+
+  Task task{priority, next_order_.fetch_add(1), std::move(fn)};
+  {
+    Queue& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto it = std::find_if(queue.tasks.begin(), queue.tasks.end(),
+        [priority](const Task& other) { return other.priority < priority; });
+    queue.tasks.insert(it, std::move(task));
+  }
+  {
+    // taking the lock orders this against a worker about to wait
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+  }
+  wait_cond_.notify_one();
+  return true;
+}
+
+void ThreadPool::parallelFor(const size_t count, const std::function<void(size_t)>& fn,
+    const int priority)
+{
+  if (count == 0) {
+    return;
+  }
+  // helpers may only get to run after everything is done and this
+  // returned, so what they touch is shared rather than on this stack
+  struct Shared
+  {
+    std::function<void(size_t)> fn;
+    size_t count;
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t done = 0;
+  };
+  auto shared = std::make_shared<Shared>();
+  shared->fn = fn;
+  shared->count = count;
+
+  auto work = [shared]() {
+    size_t finished = 0;
+    while (true) {
+      const size_t ind = shared->next.fetch_add(1);
+      if (ind >= shared->count) {
+        break;
+      }
+      try {
+        shared->fn(ind);
+      } catch (std::exception& ex) {
+        FREI0R_ERROR_STREAM("parallel task " << ind << " threw: " << ex.what());
+      }
+      ++finished;
+    }
+    if (finished == 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->done += finished;
+    }
+    shared->cond.notify_all();
+  };
+
+  const size_t helpers = std::min(count, workers_.size()) - 1;
+  for (size_t i = 0; i < helpers; ++i) {
+    if (!submit(work, priority)) {
+      break;
+    }
+  }
+  work();
+
+  std::unique_lock<std::mutex> lock(shared->mutex);
+  shared->cond.wait(lock, [&shared]() { return shared->done == shared->count; });
+}
+
+bool ThreadPool::popFrom(Queue& queue, Task& task)
+{
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  task = std::move(queue.tasks.front());
+  queue.tasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::pop(const size_t index, Task& task)
+{
+  if (popFrom(*queues_[index], task)) {
+    return true;
+  }
+
+  // steal the most important task any other worker is sitting on
+  size_t best = queues_.size();
+  int best_priority = 0;
+  uint64_t best_order = 0;
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    const size_t victim = (index + i) % queues_.size();
+    Queue& queue = *queues_[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+    const Task& front = queue.tasks.front();
+    if ((best == queues_.size()) || (front.priority > best_priority) ||
+        ((front.priority == best_priority) && (front.order < best_order))) {
+      best = victim;
+      best_priority = front.priority;
+      best_order = front.order;
+    }
+  }
+  if (best == queues_.size()) {
+    return false;
+  }
+  // it may have been taken in the meantime, the caller just looks again
+  return popFrom(*queues_[best], task);
+}
+
+void ThreadPool::run(const size_t index)
+{
+  current_pool = this;
+  current_index = index;
+  tuneCurrentThread(tuning_);
+  while (true) {
+    Task task;
+    if (pop(index, task)) {
+      queued_.fetch_sub(1);
+      try {
+        task.fn();
+      } catch (std::exception& ex) {
+        FREI0R_ERROR_STREAM("thread pool task threw: " << ex.what());
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    if (!running_) {
+      return;
+    }
+    if (queued_.load() > 0) {
+      // queued but not yet visible, or lost a steal race
+      continue;
+    }
+    wait_cond_.wait(lock, [this] { return !running_ || (queued_.load() > 0); });
+  }
+}
+
+}  // namespace frei0r_image
@@ -0,0 +1,142 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <frei0r.h>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/tiled_instance.hpp>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace frei0r_image
+{
+
+TiledInstance::TiledInstance(Plugin& plugin, const unsigned int width, const unsigned int height,
+    unsigned int tile_size, unsigned int halo, ThreadPool* pool) :
+  width_(width),
+  height_(height),
+  tile_size_(tile_size),
+  pool_(pool)
+{
+  const unsigned int align = 8;
+  tile_size = std::max((tile_size + align - 1) / align * align, align);
+  halo = (halo + align - 1) / align * align;
+
+  if (plugin.fi_.plugin_type == F0R_PLUGIN_TYPE_SOURCE) {
+    // every tile would be a whole small image of its own
+    throw std::runtime_error("can't tile source " + plugin.plugin_name_);
+  }
+  num_inputs_ = plugin.numInputs();
+
+  for (unsigned int y = 0; y < height_; y += tile_size) {
+    for (unsigned int x = 0; x < width_; x += tile_size) {
+      Tile tile;
+      tile.core = cv::Rect(x, y, std::min(tile_size, width_ - x), std::min(tile_size, height_ - y));
+      const unsigned int x0 = (x > halo) ? (x - halo) : 0;
+      const unsigned int y0 = (y > halo) ? (y - halo) : 0;
+      const unsigned int x1 = std::min(x + tile.core.width + halo, width_);
+      const unsigned int y1 = std::min(y + tile.core.height + halo, height_);
+      tile.padded = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+      tile.instance = plugin.newInstance(tile.padded.width, tile.padded.height);
+      if (!tile.instance || !tile.instance->instance_) {
+        throw std::runtime_error("no instance for a " + std::to_string(tile.padded.width)
+            + " x " + std::to_string(tile.padded.height) + " tile");
+      }
+      max_tile_pixels_ = std::max(max_tile_pixels_, static_cast<size_t>(tile.padded.area()));
+      tiles_.push_back(std::move(tile));
+    }
+  }
+  FREI0R_INFO_STREAM(width_ << " x " << height_ << " in " << tiles_.size() << " tiles of "
+      << tile_size << " with a " << halo << " pixel halo");
+}
+
+void TiledInstance::copyParams(Instance& from)
+{
+  ParamValues values;
+  values.read(from);
+  copyParams(values);
+}
+
+void TiledInstance::copyParams(const ParamValues& values)
+{
+  if (params_valid_ && (values == params_)) {
+    return;
+  }
+  for (auto& tile : tiles_) {
+    values.write(*tile.instance, params_valid_ ? &params_ : nullptr);
+  }
+  params_ = values;
+  params_valid_ = true;
+}
+
+std::unique_ptr<TiledInstance::Scratch> TiledInstance::acquireScratch()
+{
+  {
+    std::lock_guard<std::mutex> lock(scratch_mutex_);
+    if (!scratch_.empty()) {
+      auto scratch = std::move(scratch_.back());
+      scratch_.pop_back();
+      return scratch;
+    }
+  }
+  // only as many of these get made as tiles ever run at once
+  auto scratch = std::make_unique<Scratch>();
+  for (size_t i = 0; i < num_inputs_; ++i) {
+    scratch->in[i].resize(max_tile_pixels_);
+  }
+  scratch->out.resize(max_tile_pixels_);
+  return scratch;
+}
+
+void TiledInstance::releaseScratch(std::unique_ptr<Scratch> scratch)
+{
+  std::lock_guard<std::mutex> lock(scratch_mutex_);
+  scratch_.push_back(std::move(scratch));
+}
+
+void TiledInstance::updateTile(Tile& tile, const double time, cv::Mat& out)
+{
+  auto scratch = acquireScratch();
+  const cv::Size size = tile.padded.size();
+  const uint32_t* in[3] = {nullptr, nullptr, nullptr};
+  for (size_t i = 0; i < num_inputs_; ++i) {
+    cv::Mat tile_in(size.height, size.width, CV_8UC4, scratch->in[i].data());
+    image_in_[i](tile.padded).copyTo(tile_in);
+    in[i] = scratch->in[i].data();
+  }
+  tile.instance->process(time, in[0], in[1], in[2], scratch->out.data());
+
+  // drop the halo, neighboring tiles own those pixels
+  const cv::Mat tile_out(size.height, size.width, CV_8UC4, scratch->out.data());
+  const cv::Rect inner(tile.core.x - tile.padded.x, tile.core.y - tile.padded.y,
+      tile.core.width, tile.core.height);
+  cv::Mat dst = out(tile.core);
+  tile_out(inner).copyTo(dst);
+  releaseScratch(std::move(scratch));
+}
+
+void TiledInstance::update(const double time, uint32_t* out_frame)
+{
+  for (size_t i = 0; i < num_inputs_; ++i) {
+    if (image_in_[i].empty()) {
+      return;
+    }
+  }
+  cv::Mat out(height_, width_, CV_8UC4, out_frame);
+  auto run = [this, time, &out](const size_t ind) {
+    updateTile(tiles_[ind], time, out);
+  };
+  if (pool_) {
+    pool_->parallelFor(tiles_.size(), run);
+    return;
+  }
+  for (size_t i = 0; i < tiles_.size(); ++i) {
+    run(i);
+  }
+}
+
+}  // namespace frei0r_image
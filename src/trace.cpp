@@ -0,0 +1,228 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/realtime.hpp>
+#include <frei0r_image/trace.hpp>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace frei0r_image
+{
+
+namespace
+{
+const uint32_t trace_magic = 0xf0e1da7b;
+const uint32_t max_params = 64;
+const size_t align = 64;
+const size_t file_header_size = align;
+
+size_t alignUp(const size_t size)
+{
+  return (size + align - 1) / align * align;
+}
+
+const size_t slot_header_size = alignUp(sizeof(TraceSlotHeader));
+const size_t params_size = alignUp(max_params * 3 * sizeof(double));
+
+size_t slotStride(const size_t slot_size)
+{
+  return slot_header_size + params_size + alignUp(slot_size);
+}
+}  // namespace
+
+TraceWriter::TraceWriter(const std::string& path, const size_t file_size, const bool prefault) :
+  path_(path),
+  file_size_(file_size),
+  prefault_(prefault)
+{
+  // fail now rather than on the first frame
+  const int fd = open(path_.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't create trace file '" + path_ + "'");
+  }
+  ::close(fd);
+}
+
+TraceWriter::~TraceWriter()
+{
+  destroy();
+}
+
+void TraceWriter::create(const size_t slot_size)
+{
+  destroy();
+  const size_t num_slots = std::max(file_size_ / slotStride(slot_size), static_cast<size_t>(2));
+  size_ = file_header_size + num_slots * slotStride(slot_size);
+
+  // truncating first means nothing of an older layout survives
+  const int fd = open(path_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't open trace file '" + path_ + "'");
+  }
+  if (ftruncate(fd, size_) != 0) {
+    ::close(fd);
+    throw std::runtime_error("couldn't size trace file '" + path_ + "'");
+  }
+  data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    throw std::runtime_error("couldn't map trace file '" + path_ + "'");
+  }
+  if (prefault_) {
+    prefault(data_, size_);
+  }
+
+  header_ = new (data_) TraceFileHeader;
+  header_->num_slots = num_slots;
+  header_->slot_size = alignUp(slot_size);
+  header_->max_params = max_params;
+  header_->write_count.store(0);
+  for (size_t i = 0; i < num_slots; ++i) {
+    auto slot = new (static_cast<uint8_t*>(data_) + file_header_size + i * slotStride(slot_size))
+        TraceSlotHeader;
+    slot->seq.store(0);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = trace_magic;
+  FREI0R_INFO_STREAM("tracing " << num_slots << " frames of " << slot_size << " bytes into '"
+      << path_ << "'");
+}
+
+void TraceWriter::destroy()
+{
+  if (!data_) {
+    return;
+  }
+  // the file stays behind for frei0r_trace_dump
+  munmap(data_, size_);
+  data_ = nullptr;
+  header_ = nullptr;
+}
+
+void TraceWriter::write(const TraceFrame& frame, const std::string& plugin, const cv::Mat& image)
+{
+  const size_t step = image.cols * 4;
+  const size_t bytes = step * image.rows;
+  if ((!header_) || (header_->slot_size < bytes)) {
+    create(bytes);
+  }
+
+  const uint64_t count = header_->write_count.load(std::memory_order_relaxed);
+  uint8_t* data = static_cast<uint8_t*>(data_) + file_header_size +
+      (count % header_->num_slots) * slotStride(header_->slot_size);
+  auto slot = reinterpret_cast<TraceSlotHeader*>(data);
+  slot->seq.fetch_add(1, std::memory_order_acq_rel);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->index = count;
+  slot->stamp = frame.stamp;
+  std::copy(frame.input_stamps, frame.input_stamps + 3, slot->input_stamps);
+  std::copy(frame.timings, frame.timings + TraceFrame::NUM_STAGES, slot->timings);
+  slot->width = image.cols;
+  slot->height = image.rows;
+  const size_t plugin_size = std::min(plugin.size(), sizeof(slot->plugin) - 1);
+  std::memcpy(slot->plugin, plugin.data(), plugin_size);
+  slot->plugin[plugin_size] = '\0';
+
+  double* numbers = reinterpret_cast<double*>(data + slot_header_size);
+  slot->num_params = 0;
+  if (frame.params) {
+    slot->num_params = std::min(frame.params->values.size(), static_cast<size_t>(max_params));
+    for (size_t i = 0; i < slot->num_params; ++i) {
+      std::copy(frame.params->values[i].numbers, frame.params->values[i].numbers + 3,
+          numbers + i * 3);
+    }
+  }
+  cv::Mat pixels(image.rows, image.cols, CV_8UC4, data + slot_header_size + params_size, step);
+  image.copyTo(pixels);
+
+  slot->seq.fetch_add(1, std::memory_order_release);
+  header_->write_count.fetch_add(1, std::memory_order_release);
+}
+
+TraceReader::TraceReader(const std::string& path)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("couldn't open trace file '" + path + "'");
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < file_header_size)) {
+    ::close(fd);
+    throw std::runtime_error("'" + path + "' is empty");
+  }
+  data_ = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    throw std::runtime_error("couldn't map trace file '" + path + "'");
+  }
+  size_ = st.st_size;
+  header_ = static_cast<const TraceFileHeader*>(data_);
+  if ((header_->magic != trace_magic) || (header_->max_params != max_params) ||
+      (file_header_size + header_->num_slots * slotStride(header_->slot_size) > size_)) {
+    munmap(data_, size_);
+    throw std::runtime_error("'" + path + "' isn't a trace file");
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+TraceReader::~TraceReader()
+{
+  munmap(data_, size_);
+}
+
+const uint8_t* TraceReader::slot(const size_t ind) const
+{
+  if (ind >= header_->num_slots) {
+    return nullptr;
+  }
+  return static_cast<const uint8_t*>(data_) + file_header_size +
+      ind * slotStride(header_->slot_size);
+}
+
+bool TraceReader::read(const size_t ind, TraceRecord& record) const
+{
+  const uint8_t* data = slot(ind);
+  if (!data) {
+    return false;
+  }
+  auto slot_header = reinterpret_cast<const TraceSlotHeader*>(data);
+  const uint64_t seq = slot_header->seq.load(std::memory_order_acquire);
+  if ((seq == 0) || (seq % 2 == 1)) {
+    return false;
+  }
+  const size_t step = static_cast<size_t>(slot_header->width) * 4;
+  if ((step * slot_header->height > header_->slot_size) ||
+      (slot_header->num_params > max_params)) {
+    return false;
+  }
+
+  record.index = slot_header->index;
+  record.stamp = slot_header->stamp;
+  std::copy(slot_header->input_stamps, slot_header->input_stamps + 3, record.input_stamps);
+  std::copy(slot_header->timings, slot_header->timings + TraceFrame::NUM_STAGES, record.timings);
+  record.plugin = std::string(slot_header->plugin,
+      strnlen(slot_header->plugin, sizeof(slot_header->plugin)));
+  const double* numbers = reinterpret_cast<const double*>(data + slot_header_size);
+  record.params.assign(numbers, numbers + slot_header->num_params * 3);
+  const cv::Mat pixels(slot_header->height, slot_header->width, CV_8UC4,
+      const_cast<uint8_t*>(data + slot_header_size + params_size), step);
+  record.image = pixels.clone();
+
+  // order the copies before the re-check of the sequence
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot_header->seq.load(std::memory_order_relaxed) == seq;
+}
+
+}  // namespace frei0r_image
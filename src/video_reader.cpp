@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2019 Lucas Walter
+ */
+
+#include <algorithm>
+#include <frei0r_image/log.hpp>
+#include <frei0r_image/video_reader.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+#include <string>
+
+namespace frei0r_image
+{
+
+VideoReader::VideoReader(const std::string& source, const unsigned int width,
+    const unsigned int height, const size_t ring_size, const bool paced, const bool loop,
+    const double fps) :
+  source_(source),
+  paced_(paced),
+  loop_(loop),
+  size_(width, height)
+{
+  if (!capture_.open(source_)) {
+    throw std::runtime_error("can't open video '" + source_ + "'");
+  }
+  if (fps > 0.0) {
+    fps_ = fps;
+  } else if (capture_.get(cv::CAP_PROP_FPS) > 0.0) {
+    fps_ = capture_.get(cv::CAP_PROP_FPS);
+  }
+
+  // one frame can be held by the caller while the rest are decoded into
+  ring_.resize(std::max(ring_size, static_cast<size_t>(2)));
+  times_.resize(ring_.size());
+  for (auto& slot : ring_) {
+    slot.create(size_, CV_8UC4);
+  }
+  FREI0R_INFO_STREAM("reading '" << source_ << "' at " << fps_ << " fps, "
+      << (paced_ ? "paced" : "as fast as possible") << ", " << ring_.size() << " frames ahead");
+  thread_ = std::thread(&VideoReader::run, this);
+}
+
+VideoReader::~VideoReader()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void VideoReader::setSize(const unsigned int width, const unsigned int height)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_ = cv::Size(width, height);
+}
+
+uint32_t VideoReader::takeDropped()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const uint32_t dropped = dropped_;
+  dropped_ = 0;
+  return dropped;
+}
+
+bool VideoReader::next(const double time, cv::Mat& frame)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (held_) {
+    read_ = (read_ + 1) % ring_.size();
+    --count_;
+    held_ = false;
+    cond_.notify_all();
+  }
+  if (count_ == 0) {
+    return false;
+  }
+  if (start_ < 0.0) {
+    start_ = time - times_[read_];
+  }
+
+  if (paced_) {
+    const double elapsed = time - start_;
+    // skip to the newest frame that is due
+    while ((count_ > 1) && (times_[(read_ + 1) % ring_.size()] <= elapsed)) {
+      read_ = (read_ + 1) % ring_.size();
+      --count_;
+      ++dropped_;
+    }
+    cond_.notify_all();
+    if (times_[read_] > elapsed) {
+      return false;
+    }
+  }
+
+  held_ = true;
+  frame = ring_[read_];
+  return true;
+}
+
+bool VideoReader::decode(cv::Mat& slot)
+{
+  if (!capture_.read(decoded_) || decoded_.empty()) {
+    if (!loop_ || (frame_count_ == 0)) {
+      return false;
+    }
+    // reopening works for image sequences too, which can't always seek
+    capture_.release();
+    if (!capture_.open(source_) || !capture_.read(decoded_) || decoded_.empty()) {
+      return false;
+    }
+  }
+
+  const cv::Mat* src = &decoded_;
+  if (decoded_.size() != slot.size()) {
+    cv::resize(decoded_, scaled_, slot.size(), 0.0, 0.0, cv::INTER_AREA);
+    src = &scaled_;
+  }
+  // straight into the preallocated slot
+  switch (src->channels()) {
+    case (1):
+      cv::cvtColor(*src, slot, cv::COLOR_GRAY2BGRA);
+      break;
+    case (3):
+      cv::cvtColor(*src, slot, cv::COLOR_BGR2BGRA);
+      break;
+    default:
+      src->copyTo(slot);
+      break;
+  }
+  return true;
+}
+
+void VideoReader::run()
+{
+  while (true) {
+    size_t index;
+    cv::Size size;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return !running_ || (count_ < ring_.size()); });
+      if (!running_) {
+        return;
+      }
+      // nothing else touches slots past the decoded ones
+      index = (read_ + count_) % ring_.size();
+      size = size_;
+    }
+
+    cv::Mat& slot = ring_[index];
+    if (slot.size() != size) {
+      slot.create(size, CV_8UC4);
+    }
+    if (!decode(slot)) {
+      FREI0R_INFO_STREAM("end of '" << source_ << "' after " << frame_count_ << " frames");
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    times_[index] = frame_count_ / fps_;
+    ++frame_count_;
+    ++count_;
+  }
+}
+
+}  // namespace frei0r_image